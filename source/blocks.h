@@ -55,4 +55,84 @@ static bool blockLegal(Position& state, std::vector<Block>& blocks, Position& mo
 	return true;
 }
 
+
+// The Blocks as a pruning table over one set can check them, per move in the order of
+// moves. Pieces of other sets, and of this one if knownPieces is false or relabel gives
+// them a label of their own, are only known to move or stay if the move changes all or
+// none of the positions of their set, so a Block is only checked as far as that goes.
+// Empty if no Block restricts the set.
+static std::vector<moveblocks> setBlockRules(MoveList& moves, int setname, std::vector<Block>& blocks, bool knownPieces, std::vector<int> relabel = std::vector<int>()){
+	std::vector<moveblocks> rules;
+	bool restricted = false;
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++) {
+		Position& move = iter->second.state;
+		moveblocks current;
+		current.legal = true;
+		for (int i = 0; i < move[setname].size; i++)
+			if (move[setname].permutation[i] != i+1 || move[setname].orientation[i] != 0)
+				current.touched.push_back(i);
+
+		for (unsigned int b = 0; b < blocks.size(); b++){
+			bool moved = false, stationary = false;
+			blockrule rule;
+			Block::iterator set_iter;
+			for (set_iter = blocks[b].begin(); set_iter != blocks[b].end(); set_iter++){
+				int set = set_iter->first;
+				if (set == setname && knownPieces) {
+					bool unknown = false;
+					std::set<int>::iterator piece_iter;
+					for (piece_iter = set_iter->second.begin(); piece_iter != set_iter->second.end(); piece_iter++) {
+						if (relabel.empty() || *piece_iter >= (int) relabel.size() || relabel[*piece_iter] == *piece_iter)
+							rule.pieces.push_back(*piece_iter);
+						else
+							unknown = true;
+					}
+					if (!unknown)
+						continue;
+				}
+				int changed = 0;
+				for (int i = 0; i < move[set].size; i++)
+					if (move[set].permutation[i] != i+1 || move[set].orientation[i] != 0)
+						changed++;
+				if (changed == 0)
+					stationary = true;
+				else if (changed == move[set].size)
+					moved = true;
+			}
+			if (moved && stationary)
+				current.legal = false;
+			else if (!rule.pieces.empty() && (moved || stationary || rule.pieces.size() > 1)) {
+				rule.required = moved ? 1 : (stationary ? 0 : -1);
+				current.rules.push_back(rule);
+			}
+		}
+		restricted = restricted || !current.legal || !current.rules.empty();
+		rules.push_back(current);
+	}
+	if (!restricted)
+		rules.clear();
+	return rules;
+}
+
+// Whether a move from rules can be made on permutation (of the set the rules are for)
+static bool setBlockLegal(int permutation[], moveblocks& rules){
+	if (!rules.legal)
+		return false;
+	for (unsigned int r = 0; r < rules.rules.size(); r++){
+		blockrule& rule = rules.rules[r];
+		bool moved = false, stationary = false;
+		for (unsigned int p = 0; p < rule.pieces.size(); p++){
+			bool changed = false;
+			for (unsigned int i = 0; i < rules.touched.size(); i++)
+				changed = changed || permutation[rules.touched[i]] == rule.pieces[p];
+			moved = moved || changed;
+			stationary = stationary || !changed;
+		}
+		if ((moved && stationary) || (rule.required == 1 && stationary) || (rule.required == 0 && moved))
+			return false;
+	}
+	return true;
+}
+
 #endif
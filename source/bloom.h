@@ -0,0 +1,102 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for the Bloom filters that sit in front of partial pruning tables
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+// Hash a key as stored in a partial table (see packVector)
+static unsigned long long bloomHash(const std::vector<long long>& key) {
+	unsigned long long h = key.size();
+	for (unsigned int i = 0; i < key.size(); i++)
+		h = hashMix(h, key[i]);
+	return hashFinish(h);
+}
+
+// Hash an array the same way as bloomHash(packVector(vec, size)), without building the key
+static unsigned long long bloomHash(int vec[], int size) {
+	int words = 1 + size/8;
+	unsigned long long h = words;
+	for (int i = 0; i < 8*words; i += 8) {
+		long long element = 0;
+		for (int j = 0; j < 8; j++)
+			if (i+j < size) element += (1LL+vec[i+j]) << (8*j);
+		h = hashMix(h, element);
+	}
+	return hashFinish(h);
+}
+
+// First block of the filter, aligned to a cache line
+static unsigned long long* bloomBlocks(bloomfilter& filter) {
+	unsigned long long *words = filter.words.data();
+	return (unsigned long long*) (((size_t) words + 63) & ~(size_t) 63);
+}
+
+// The block for a hash; the bits within it come from the low bits of the hash
+static unsigned long long* bloomBlock(bloomfilter& filter, unsigned long long h) {
+	unsigned long long b = hashFinish(h ^ 0x5bd1e995) % filter.blocks;
+	return bloomBlocks(filter) + b * BLOOM_BLOCK_WORDS;
+}
+
+static void bloomInsert(bloomfilter& filter, unsigned long long h) {
+	unsigned long long *block = bloomBlock(filter, h);
+	for (int i = 0; i < BLOOM_PROBES; i++) {
+		int bit = (h >> (9*i)) & 511;
+		block[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+// false means the key is certainly not in the table
+static bool bloomMayContain(bloomfilter& filter, unsigned long long h) {
+	unsigned long long *block = bloomBlock(filter, h);
+	for (int i = 0; i < BLOOM_PROBES; i++) {
+		int bit = (h >> (9*i)) & 511;
+		if ((block[bit >> 6] & (1ULL << (bit & 63))) == 0)
+			return false;
+	}
+	return true;
+}
+
+static void buildBloomFilter(bloomfilter& filter, PARTIAL_TABLE_CONTAINER_TYPE& table) {
+	filter.blocks = (table.size() * BLOOM_BITS_PER_ENTRY + 64*BLOOM_BLOCK_WORDS - 1) / (64*BLOOM_BLOCK_WORDS);
+	if (filter.blocks < 1)
+		filter.blocks = 1;
+	filter.words.assign((filter.blocks + 1) * BLOOM_BLOCK_WORDS, 0);
+	PARTIAL_TABLE_CONTAINER_TYPE::iterator iter;
+	for (iter = table.begin(); iter != table.end(); iter++)
+		bloomInsert(filter, bloomHash(iter->first));
+}
+
+// Build a filter for every partial table
+static void buildBloomFilters(PruneTable& tables) {
+	PruneTable::iterator iter;
+	for (iter = tables.begin(); iter != tables.end(); iter++) {
+		if (iter->second.partialpermutation.size() >= 1) {
+			buildBloomFilter(iter->second.partialpermutation_bloom, iter->second.partialpermutation);
+			std::cout << "Bloom filter for " << setnameFromIndex(iter->first) << " permutation: " << iter->second.partialpermutation_bloom.blocks * 64 << " bytes.\n";
+		}
+		if (iter->second.partialorientation.size() >= 1) {
+			buildBloomFilter(iter->second.partialorientation_bloom, iter->second.partialorientation);
+			std::cout << "Bloom filter for " << setnameFromIndex(iter->first) << " orientation: " << iter->second.partialorientation_bloom.blocks * 64 << " bytes.\n";
+		}
+	}
+}
+
+#endif
@@ -17,7 +17,7 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-// Functions to check whether permutations are unique.
+// Functions to check whether permutations are unique, and their parity.
 
 #ifndef CHECKS_H
 #define CHECKS_H
@@ -56,4 +56,18 @@ static bool uniquePermutation(int test[], int size) {
    return true;
 }
 
+// Is a permutation of 1,..,n odd? Counts the cycles.
+static bool oddPermutation(int perm[], int size) {
+	std::vector<bool> seen (size, false);
+	int cycles = 0;
+	for (int i = 0; i < size; i++) {
+		if (seen[i])
+			continue;
+		cycles++;
+		for (int j = i; !seen[j]; j = perm[j] - 1)
+			seen[j] = true;
+	}
+	return (size - cycles) % 2 == 1;
+}
+
 #endif
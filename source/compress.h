@@ -0,0 +1,214 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for compressing complete pruning tables. Tables are cut into blocks of
+// TABLE_CHUNK entries, and each block is coded with its own canonical Huffman code,
+// so blocks can be compressed and decompressed independently and in parallel.
+//
+// A compressed section holds the number of blocks, then for every block the offset
+// where it ends and a checksum of its decompressed entries, then the blocks. Each
+// block is 256 code lengths (one per byte value) followed by the bit stream.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Code lengths for the byte frequencies, at most HUFFMAN_MAX_BITS long
+static void huffmanLengths(const long long freq[256], unsigned char lengths[256]) {
+	std::vector<long long> f(freq, freq + 256);
+	while (true) {
+		// nodes 0-255 are the symbols, the rest are merged nodes
+		std::vector<int> parent(512, -1);
+		std::priority_queue<std::pair<long long, int>, std::vector<std::pair<long long, int> >, std::greater<std::pair<long long, int> > > queue;
+		for (int i = 0; i < 256; i++)
+			if (f[i] > 0)
+				queue.push(std::make_pair(f[i], i));
+		memset(lengths, 0, 256);
+		if (queue.size() == 1) {
+			lengths[queue.top().second] = 1;
+			return;
+		}
+		int next = 256;
+		while (queue.size() > 1) {
+			std::pair<long long, int> a = queue.top(); queue.pop();
+			std::pair<long long, int> b = queue.top(); queue.pop();
+			parent[a.second] = parent[b.second] = next;
+			queue.push(std::make_pair(a.first + b.first, next++));
+		}
+		int longest = 0;
+		for (int i = 0; i < 256; i++) {
+			if (f[i] == 0)
+				continue;
+			int len = 0;
+			for (int n = i; parent[n] != -1; n = parent[n])
+				len++;
+			lengths[i] = len;
+			longest = std::max(longest, len);
+		}
+		if (longest <= HUFFMAN_MAX_BITS)
+			return;
+		// too long: flatten the distribution and try again
+		for (int i = 0; i < 256; i++)
+			if (f[i] > 0)
+				f[i] = (f[i] + 1) / 2;
+	}
+}
+
+// Canonical codes: by length, then by symbol
+static void huffmanCodes(const unsigned char lengths[256], unsigned int codes[256]) {
+	unsigned int code = 0;
+	for (int len = 1; len <= HUFFMAN_MAX_BITS; len++) {
+		for (int i = 0; i < 256; i++)
+			if (lengths[i] == len)
+				codes[i] = code++;
+		code <<= 1;
+	}
+}
+
+// Append one compressed block to out
+static void compressBlock(const char *data, long long size, std::vector<char>& out) {
+	long long freq[256] = {0};
+	for (long long i = 0; i < size; i++)
+		freq[(unsigned char) data[i]]++;
+	unsigned char lengths[256];
+	unsigned int codes[256];
+	huffmanLengths(freq, lengths);
+	huffmanCodes(lengths, codes);
+	out.insert(out.end(), (char*) lengths, (char*) lengths + 256);
+
+	unsigned long long buffer = 0;
+	int bits = 0;
+	for (long long i = 0; i < size; i++) {
+		unsigned char c = data[i];
+		buffer = (buffer << lengths[c]) | codes[c];
+		bits += lengths[c];
+		while (bits >= 8) {
+			bits -= 8;
+			out.push_back((char) (buffer >> bits));
+		}
+	}
+	if (bits > 0)
+		out.push_back((char) (buffer << (8 - bits)));
+}
+
+// Decompress one block of size entries; false if the block is malformed
+static bool decompressBlock(const char *in, long long length, char *data, long long size) {
+	if (length < 256)
+		return false;
+	const unsigned char *lengths = (const unsigned char*) in;
+	unsigned int codes[256];
+	huffmanCodes(lengths, codes);
+	// lookup table on the next HUFFMAN_MAX_BITS bits: symbol and code length
+	std::vector<unsigned short> lookup(1 << HUFFMAN_MAX_BITS, 0);
+	for (int i = 0; i < 256; i++) {
+		int len = lengths[i];
+		if (len == 0)
+			continue;
+		if (len > HUFFMAN_MAX_BITS)
+			return false;
+		unsigned int first = codes[i] << (HUFFMAN_MAX_BITS - len);
+		unsigned int last = (codes[i] + 1) << (HUFFMAN_MAX_BITS - len);
+		if (last > lookup.size())
+			return false;
+		for (unsigned int j = first; j < last; j++)
+			lookup[j] = (len << 8) | i;
+	}
+
+	const unsigned char *bytes = (const unsigned char*) in + 256;
+	long long available = length - 256, pos = 0;
+	unsigned long long buffer = 0; // next bits, left-aligned
+	int bits = 0;
+	for (long long i = 0; i < size; i++) {
+		while (bits <= 56 && pos < available) {
+			buffer |= (unsigned long long) bytes[pos++] << (56 - bits);
+			bits += 8;
+		}
+		unsigned short entry = lookup[buffer >> (64 - HUFFMAN_MAX_BITS)];
+		int len = entry >> 8;
+		if (len == 0 || len > bits)
+			return false;
+		data[i] = (char) (entry & 0xff);
+		buffer <<= len;
+		bits -= len;
+	}
+	return true;
+}
+
+// Bytes at the start of a compressed section covered by the section checksum
+static long long compressedDirectoryLength(const char *data) {
+	return (1 + 2*((const unsigned long long*) data)[0]) * sizeof(unsigned long long);
+}
+
+// Compressed form of a complete table, blocks compressed in parallel
+static void compressTable(const char *data, long long size, std::vector<char>& out) {
+	long long blocks = (size + TABLE_CHUNK - 1) / TABLE_CHUNK;
+	std::vector<std::vector<char> > compressed(blocks);
+	std::vector<unsigned long long> directory(1 + 2*blocks);
+	#pragma omp parallel for schedule(dynamic)
+	for (long long b = 0; b < blocks; b++) {
+		long long n = std::min(TABLE_CHUNK, size - b*TABLE_CHUNK);
+		compressBlock(data + b*TABLE_CHUNK, n, compressed[b]);
+		directory[2 + 2*b] = hashBytes(data + b*TABLE_CHUNK, n, b);
+	}
+	directory[0] = blocks;
+	unsigned long long end = directory.size() * sizeof(unsigned long long);
+	for (long long b = 0; b < blocks; b++) {
+		end += compressed[b].size();
+		directory[1 + 2*b] = end;
+	}
+	out.assign((char*) directory.data(), (char*) (directory.data() + directory.size()));
+	for (long long b = 0; b < blocks; b++)
+		out.insert(out.end(), compressed[b].begin(), compressed[b].end());
+}
+
+// Read a compressed section into a table of size entries. Every thread reads and
+// decompresses its own blocks straight from the file, checking each block's checksum.
+static bool decompressTable(int fd, tablesection& section, char *data) {
+	unsigned long long offset = section.offset, length = section.length;
+	long long size = section.entries;
+	unsigned long long blocks;
+	if (length < sizeof(blocks) || !readTableBytes(fd, (char*) &blocks, sizeof(blocks), offset) ||
+		blocks != (unsigned long long) (size + TABLE_CHUNK - 1) / TABLE_CHUNK ||
+		(1 + 2*blocks) * sizeof(unsigned long long) > length)
+		return false;
+	std::vector<unsigned long long> directory(1 + 2*blocks);
+	if (!readTableBytes(fd, (char*) directory.data(), directory.size()*sizeof(unsigned long long), offset) ||
+		tableChecksum((char*) directory.data(), directory.size()*sizeof(unsigned long long)) != section.checksum)
+		return false;
+	bool ok = true;
+	#pragma omp parallel for schedule(dynamic)
+	for (long long b = 0; b < (long long) blocks; b++) {
+		unsigned long long start = (b == 0) ? directory.size()*sizeof(unsigned long long) : directory[2*b - 1];
+		unsigned long long end = directory[1 + 2*b];
+		long long n = std::min(TABLE_CHUNK, size - b*TABLE_CHUNK);
+		bool good = start <= end && end <= length;
+		if (good) {
+			std::vector<char> in(end - start);
+			good = readTableBytes(fd, in.data(), in.size(), offset + start) &&
+				decompressBlock(in.data(), in.size(), data + b*TABLE_CHUNK, n) &&
+				hashBytes(data + b*TABLE_CHUNK, n, b) == directory[2 + 2*b];
+		}
+		if (!good) {
+			#pragma omp critical
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+#endif
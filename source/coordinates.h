@@ -0,0 +1,402 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for the coordinate search. It searches the same tree as treeSolve, but a node
+// is the index of the position in each complete pruning table, and a move table per table
+// gives the index after each move, so a node costs a few table loads instead of applying
+// the move to every set and ranking the result. Sets that other lookups need are kept as
+// states; whole positions are only put together by replaying the moves at a leaf that
+// the tables let through.
+
+#ifndef COORDINATES_H
+#define COORDINATES_H
+
+// Move tables, by set, kind of index and the IDs of the moves, kept for later scrambles
+static std::map<std::vector<int>, std::vector<int> >& coordinateMoveTables() {
+	static std::map<std::vector<int>, std::vector<int> > tables;
+	return tables;
+}
+
+// The index of a set in a table of the given kind; labels are the permutation as the
+// table sees it
+static long long coordinateIndex(int kind, substate& sub, int *labels, int omod) {
+	if (kind == PROBE_ORIENTATION_COMPLETE)
+		return oVector2Index(sub.orientation, sub.size, omod);
+	if (kind == PROBE_PERMUTATION_COMPLETE)
+		return pVector2Index(labels, sub.size);
+	return pVector3Index(labels, sub.size);
+}
+
+// The index of each position after each move, for the table of probe. solvedLabels are the
+// labels of the solved permutation as the table sees them, which a combination index needs
+// to be turned back into a permutation.
+static std::vector<int>* coordinateMoveTable(pruneprobe& probe, std::vector<int>& solvedLabels, std::vector<MoveList::iterator>& moves) {
+	std::vector<int> key;
+	key.push_back(probe.set);
+	key.push_back(probe.kind);
+	for (unsigned int m = 0; m < moves.size(); m++)
+		key.push_back(moves[m]->first);
+	std::map<std::vector<int>, std::vector<int> >::iterator found = coordinateMoveTables().find(key);
+	if (found != coordinateMoveTables().end())
+		return &found->second;
+
+	std::vector<int>& table = coordinateMoveTables()[key];
+	completetable& entries = probe.kind == PROBE_ORIENTATION_COMPLETE ? probe.table->orientation : probe.table->permutation;
+	long long count = entries.size;
+	int n = moves.size();
+	int size = solvedLabels.size();
+	table.resize(count * n);
+	if (verbose)
+		std::cout << "Building move table for " << setnameFromIndex(probe.set) << (probe.kind == PROBE_ORIENTATION_COMPLETE ? " orientation" : " permutation") << ".\n";
+
+	#pragma omp parallel
+	{
+		substate from = newSubstate(size);
+		substate to = newSubstate(size);
+		#pragma omp for schedule(dynamic, 1024)
+		for (long long c = 0; c < count; c++) {
+			memset(from.orientation, 0, size*sizeof(int));
+			if (probe.kind == PROBE_ORIENTATION_COMPLETE) {
+				oIndex2Array(c, size, probe.omod, from.orientation);
+				for (int i = 0; i < size; i++)
+					from.permutation[i] = i + 1;
+			} else if (probe.kind == PROBE_PERMUTATION_COMPLETE) {
+				pIndex2Array(c, size, from.permutation);
+			} else {
+				pIndex3Array(c, solvedLabels.data(), size, from.permutation);
+			}
+			for (int m = 0; m < n; m++) {
+				applySubstateMove(from, to, moves[m]->second.state[probe.set], probe.omod);
+				table[c * n + m] = coordinateIndex(probe.kind, to, to.permutation, probe.omod);
+			}
+		}
+		delete[] from.permutation;
+		delete[] from.orientation;
+		delete[] to.permutation;
+		delete[] to.orientation;
+	}
+	return &table;
+}
+
+// Does the table of a set count every solved position of the scramble as solved? It does
+// if the scramble ignores no more of the set than the def does.
+static bool coordinateLeaves(ScrambleDef& scramble, Position& ignore, int set, bool orientation) {
+	if (scramble.ignore.size() == 0)
+		return true;
+	substate& flags = scramble.ignore[set];
+	if (flags.size == 0)
+		return false; // the set is not checked at all
+	std::vector<int> allowed = ignoreFlags(ignore, set, orientation);
+	int *ign = orientation ? flags.orientation : flags.permutation;
+	for (int i = 0; i < flags.size; i++)
+		if (ign[i] != 0 && (allowed.empty() || allowed[i] == 0))
+			return false;
+	return true;
+}
+
+// Set up the coordinate search of a scramble. False if it can't be used: with Blocks or
+// move limits, which need whole positions at every node, with the transposition table,
+// or if no complete table in memory has a small enough move table.
+static bool coordPrepare(coordengine& engine, ScrambleDef& scramble, Position& solved, MoveList& moves, PieceTypes& datasets, probeset& probes, std::set<MovePair>& forbiddenPairs, Position& ignore, std::vector<Block>& blocks) {
+	if (skipPrune || blocks.size() != 0 || scramble.moveLimits.size() != 0 || transpositions().active)
+		return false;
+	engine.scramble = &scramble;
+	engine.solved = &solved;
+	engine.datasets = &datasets;
+	engine.tables = probes.tables;
+	engine.moves.clear();
+	engine.cost.clear();
+	engine.probes.clear();
+	engine.carried.clear();
+	engine.root.clear();
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++) {
+		engine.moves.push_back(iter);
+		engine.cost.push_back(scramble.metric == 0 ? 1 : iter->second.qtm);
+	}
+	int n = engine.moves.size();
+	engine.allowed.assign((n + 1) * n, 1);
+	for (int previous = 0; previous < n; previous++)
+		for (int m = 0; m < n; m++)
+			if (forbiddenPairs.find(MovePair(engine.moves[previous]->first, engine.moves[m]->first)) != forbiddenPairs.end())
+				engine.allowed[(previous + 1) * n + m] = 0;
+
+	engine.coordinate.assign(probes.probes.size(), 0);
+	std::set<int> carried;
+	for (unsigned int i = 0; i < probes.probes.size(); i++) {
+		pruneprobe& probe = probes.probes[i];
+		substate& sub = scramble.state[probe.set];
+		bool complete = probe.kind == PROBE_ORIENTATION_COMPLETE || probe.kind == PROBE_PERMUTATION_COMPLETE || probe.kind == PROBE_PERMUTATION_COMBINATION;
+		completetable& entries = probe.kind == PROBE_ORIENTATION_COMPLETE ? probe.table->orientation : probe.table->permutation;
+		bool usable = complete && entries.disk == NULL && entries.data != NULL && entries.size <= INT_MAX
+			&& entries.size * n <= COORDINATE_MAX_MOVE_TABLE;
+
+		// the scramble has to be a position the table has an index for
+		std::vector<int> solvedLabels = tableSolved(solved, ignore, probe.set);
+		if (probe.kind == PROBE_ORIENTATION_COMPLETE) {
+			for (int j = 0; j < sub.size; j++)
+				usable = usable && sub.orientation[j] >= 0 && sub.orientation[j] < probe.omod;
+		} else if (usable) {
+			int *labels = tablePermutation(sub, *probe.table);
+			std::vector<int> have(labels, labels + sub.size);
+			std::vector<int> want = solvedLabels;
+			if (probe.kind == PROBE_PERMUTATION_COMPLETE)
+				for (int j = 0; j < sub.size; j++)
+					want[j] = j + 1;
+			std::sort(have.begin(), have.end());
+			std::sort(want.begin(), want.end());
+			usable = have == want;
+		}
+		if (!usable) {
+			carried.insert(probe.set);
+			continue;
+		}
+
+		coordprobe cp;
+		cp.probe = i;
+		cp.kind = probe.kind;
+		cp.moves = coordinateMoveTable(probe, solvedLabels, engine.moves);
+		cp.leaves = coordinateLeaves(scramble, ignore, probe.set, probe.kind == PROBE_ORIENTATION_COMPLETE);
+		engine.probes.push_back(cp);
+		engine.coordinate[i] = 1;
+		engine.root.push_back(coordinateIndex(probe.kind, sub, tablePermutation(sub, *probe.table), probe.omod));
+	}
+	engine.carried.assign(carried.begin(), carried.end());
+	if (engine.probes.empty())
+		return false;
+	if (verbose)
+		std::cout << "Coordinate search with " << engine.probes.size() << " move tables and " << engine.carried.size() << " sets kept as states.\n";
+	return true;
+}
+
+// Room for a thread or task to search to the depth of the engine, with its own lookups
+static coordsearch startCoordSearch(coordengine& engine, std::vector<std::vector<int> >& order) {
+	coordsearch search;
+	search.engine = &engine;
+	search.order = order;
+	probeset local = threadProbes(*engine.datasets, *engine.tables, order);
+	for (unsigned int i = 0; i < engine.probes.size(); i++) {
+		pruneprobe& probe = local.probes[engine.probes[i].probe];
+		search.data.push_back(probe.kind == PROBE_ORIENTATION_COMPLETE ? probe.table->orientation.data : probe.table->permutation.data);
+	}
+
+	// the other lookups, in the order learned for them
+	std::vector<int> remap(local.probes.size(), -1);
+	search.probes = local;
+	search.probes.probes.clear();
+	for (unsigned int i = 0; i < local.probes.size(); i++)
+		if (!engine.coordinate[i]) {
+			remap[i] = search.probes.probes.size();
+			search.probes.probes.push_back(local.probes[i]);
+		}
+	for (unsigned int d = 0; d < search.probes.order.size(); d++) {
+		std::vector<int> kept;
+		for (unsigned int k = 0; k < local.order[d].size(); k++)
+			if (remap[local.order[d][k]] >= 0)
+				kept.push_back(remap[local.order[d][k]]);
+		search.probes.order[d] = kept;
+		search.probes.stats[d].resize(search.probes.probes.size());
+	}
+
+	int n = engine.moves.size();
+	int nc = engine.probes.size();
+	int levels = engine.plies + 1;
+	search.coords.resize(levels * nc);
+	search.children.resize(levels * n);
+	search.childCoords.resize(levels * n * nc);
+	search.path.resize(levels);
+	Position& scramble = engine.scramble->state;
+	search.states.resize(engine.carried.empty() ? 0 : levels);
+	for (unsigned int l = 0; l < search.states.size(); l++)
+		search.states[l] = copyPosition(scramble);
+	search.replay[0] = copyPosition(scramble);
+	search.replay[1] = copyPosition(scramble);
+	return search;
+}
+
+static void freeCoordSearch(coordsearch& search) {
+	for (unsigned int l = 0; l < search.states.size(); l++)
+		freePosition(search.states[l]);
+	freePosition(search.replay[0]);
+	freePosition(search.replay[1]);
+}
+
+// Search for solutions of exactly depth moves with the coordinate search, like treeSolve
+static bool coordSolve(coordengine& engine, probeset& probes, int depth) {
+	ScrambleDef& scramble = *engine.scramble;
+	if (depth <= 0) {
+		if (isSolved(scramble.state, *engine.solved, scramble.ignore, *engine.datasets)) {
+			string sequence = " ";
+			reportSolution(sequence);
+			return true;
+		}
+		recordExcess(1);
+		return false;
+	}
+	if (prune(scramble.state, depth, probes)) {
+		recordExcess(1);
+		return false;
+	}
+
+	engine.plies = depth;
+	bool success = false;
+	#pragma omp parallel
+	#pragma omp single
+	{
+		coordsearch search = startCoordSearch(engine, probes.order);
+		memcpy(search.coords.data(), engine.root.data(), engine.root.size()*sizeof(int));
+		success = coordSearch(search, 0, depth, -1);
+		freeCoordSearch(search);
+	}
+	return success;
+}
+
+// Replay the moves to a leaf, and see whether it is solved
+static bool coordSolved(coordsearch& search, int ply) {
+	coordengine& engine = *search.engine;
+	Position *state = &engine.scramble->state;
+	for (int i = 0; i < ply; i++) {
+		applyMove(*state, search.replay[i & 1], engine.moves[search.path[i]]->second.state, *engine.datasets);
+		state = &search.replay[i & 1];
+	}
+	return isSolved(*state, *engine.solved, engine.scramble->ignore, *engine.datasets);
+}
+
+// Search the children of the node at level ply, which has depth moves left and was
+// entered by the move with index previous. Like treeSolve, it records how far the cut
+// off children were from fitting in depth.
+static bool coordSearch(coordsearch& search, int ply, int depth, int previous) {
+	coordengine& engine = *search.engine;
+	int n = engine.moves.size();
+	int nc = engine.probes.size();
+	int *coords = &search.coords[ply * nc];
+	int *next = &search.childCoords[ply * n * nc];
+	int *children = &search.children[ply * n];
+	char *allowed = &engine.allowed[(previous + 1) * n];
+	bool carrying = !engine.carried.empty();
+	countNode();
+
+	// first pass: the indices of all children, prefetching their entries
+	int count = 0;
+	int excess = INT_MAX;
+	for (int m = 0; m < n; m++) {
+		if (!allowed[m])
+			continue;
+		if (engine.cost[m] > depth) {
+			excess = std::min(excess, engine.cost[m] - depth);
+			continue;
+		}
+		int *child = next + count * nc;
+		for (int p = 0; p < nc; p++) {
+			child[p] = (*engine.probes[p].moves)[(long long) coords[p] * n + m];
+			__builtin_prefetch(search.data[p] + child[p]);
+		}
+		children[count++] = m;
+	}
+
+	// second pass: look them up, and recurse into the ones that survive
+	bool success = false;
+	bool spawned = false;
+	bool taskSuccess = false;
+	for (int k = 0; k < count && !searchStopped(); k++) {
+		int m = children[k];
+		int newDepth = depth - engine.cost[m];
+		int *child = next + k * nc;
+		bool cut = false;
+		for (int p = 0; p < nc && !cut; p++)
+			if ((newDepth > 0 || engine.probes[p].leaves) && search.data[p][child[p]] > newDepth) {
+				cut = true;
+				excess = std::min(excess, search.data[p][child[p]] - newDepth);
+			}
+		if (cut)
+			continue;
+
+		search.path[ply] = m;
+		if (newDepth == 0) {
+			if (coordSolved(search, ply + 1)) {
+				string sequence = " ";
+				for (int i = 0; i <= ply; i++)
+					sequence += " " + engine.moves[search.path[i]]->second.name;
+				reportSolution(sequence);
+				success = true;
+			} else
+				excess = 1;
+			continue;
+		}
+		if (carrying) {
+			Position& state = search.states[ply];
+			Position& new_state = search.states[ply + 1];
+			Position& move = engine.moves[m]->second.state;
+			for (unsigned int i = 0; i < engine.carried.size(); i++) {
+				int s = engine.carried[i];
+				applySubstateMove(state[s], new_state[s], move[s], (*engine.datasets)[s].omod);
+			}
+			if (!search.probes.probes.empty() && prune(new_state, newDepth, search.probes)) {
+				excess = 1;
+				continue;
+			}
+		}
+		memcpy(&search.coords[(ply + 1) * nc], child, nc*sizeof(int));
+
+		// recurse! Big subtrees become tasks, while the other threads need work
+		if (spawnSearchTask(newDepth)) {
+			std::vector<int> taskCoords(child, child + nc);
+			std::vector<int> taskPath(search.path.begin(), search.path.begin() + ply + 1);
+			Position taskState;
+			if (carrying)
+				taskState = copyPosition(search.states[ply + 1]);
+			std::vector<std::vector<int> > taskOrder = search.order;
+			int level = ply + 1;
+			spawned = true;
+			#pragma omp task default(shared) firstprivate(taskCoords, taskPath, taskState, taskOrder, level, newDepth, m)
+			{
+				if (!searchStopped()) {
+					coordsearch task = startCoordSearch(engine, taskOrder);
+					memcpy(&task.coords[level * nc], taskCoords.data(), nc*sizeof(int));
+					std::copy(taskPath.begin(), taskPath.end(), task.path.begin());
+					if (carrying)
+						for (unsigned int i = 0; i < engine.carried.size(); i++) {
+							int s = engine.carried[i];
+							memcpy(task.states[level][s].permutation, taskState[s].permutation, taskState[s].size*sizeof(int));
+							memcpy(task.states[level][s].orientation, taskState[s].orientation, taskState[s].size*sizeof(int));
+						}
+					if (coordSearch(task, level, newDepth, m)) {
+						#pragma omp atomic write
+						taskSuccess = true;
+					}
+					freeCoordSearch(task);
+				}
+				if (carrying)
+					freePosition(taskState);
+				pendingSearchTasks()--;
+			}
+		}
+		else if (coordSearch(search, ply + 1, newDepth, m))
+			success = true;
+	}
+	if (spawned) {
+		#pragma omp taskwait
+		success = success || taskSuccess;
+	}
+	if (excess != INT_MAX)
+		recordExcess(excess);
+	return success;
+}
+
+#endif
@@ -32,12 +32,106 @@ static const int MAX_COMPLETE_PERMUTATION_TABLE_SIZE = 10000000; // >10! (perm o
 static const int MAX_COMPLETE_ORIENTATION_TABLE_SIZE = 10000000; // Complete tables contain one int (4 byte) per entry.
 static const int MAX_PARTIAL_PERMUTATION_TABLE_SIZE = 1000000; // Max number of entries in a partial table.
 static const int MAX_PARTIAL_ORIENTATION_TABLE_SIZE = 1000000; // SIZE is number of entries.
+static const int PINDEX3_ARRAY_LABELS = 64; // pVector3Index counts labels below this in an array
 
 // The types of pruning tables. 
 static const int TABLE_TYPE_NONE = 0;
 static const int TABLE_TYPE_COMPLETE = 1;
 static const int TABLE_TYPE_PARTIAL = 2;
 
+// Pruning table files. Sections start on 64-byte boundaries so complete tables can be used from a mapping.
+static const unsigned long long TABLE_FILE_MAGIC = 0x425465766c6f736bULL; // "ksolveTB"
+static const unsigned int TABLE_FILE_VERSION = 3;
+static const int TABLE_FILE_ALIGN = 64;
+static const int TABLE_RELABELLED = 0x4c424c; // in the cache key of permutation tables with collapsed ignored pieces
+static const long long TABLE_CHUNK = 1 << 20; // checksums are computed per chunk, in parallel
+static const long long TABLE_SAMPLE_CHUNKS = 8; // chunks of a complete table hashed again when it is loaded
+
+// The kinds of sections in a pruning table file.
+static const int SECTION_PERMUTATION_COMPLETE = 1;
+static const int SECTION_PERMUTATION_PARTIAL = 2;
+static const int SECTION_ORIENTATION_COMPLETE = 3;
+static const int SECTION_ORIENTATION_PARTIAL = 4;
+static const int SECTION_PERMUTATION_COMPRESSED = 5; // complete tables coded with compressTable
+static const int SECTION_ORIENTATION_COMPRESSED = 6;
+static const int HUFFMAN_MAX_BITS = 12; // longest code in a compressed block
+
+// Results of reading a pruning table file.
+static const int TABLE_FILE_OK = 0;
+static const int TABLE_FILE_MISSING = 1;
+static const int TABLE_FILE_STALE = 2; // built from a different def
+static const int TABLE_FILE_CORRUPT = 3; // bad header, old format, or checksum mismatch
+
+// Where the entries of a complete table live.
+static const int TABLE_BACKING_HEAP = 0;
+static const int TABLE_BACKING_MAPPED = 1; // read-only mapping of a table file or shared segment
+static const int TABLE_BACKING_HUGETLB = 2; // explicit huge pages
+static const int TABLE_BACKING_TRANSPARENT = 3; // anonymous mapping advised to use transparent huge pages
+static const long long HUGE_PAGE_SIZE = 2 << 20; // tables smaller than this stay on the heap
+
+// NUMA placement of pruning tables
+static const int NUMA_NONE = 0;
+static const int NUMA_INTERLEAVE = 1; // spread pages over all nodes
+static const int NUMA_REPLICATE = 2; // interleave, and copy the smaller tables to every node
+static const long long NUMA_REPLICATE_LIMIT = 64 << 20; // largest complete table copied to every node
+static const int NUMA_MAX_NODES = 64;
+
+// Complete tables larger than the MAX_COMPLETE sizes, allowed with an out-of-core budget
+static const long long OUT_OF_CORE_MAX_TABLE_SIZE = 1LL << 40; // largest complete table kept on disk
+static const int OUT_OF_CORE_COARSE_SHARE = 64; // the coarse table has at most one entry per 64 of the table
+static const long long OUT_OF_CORE_CHECK = 1 << 16; // disk lookups between checks of the resident size, at the most
+static const long long OUT_OF_CORE_BUILD_CHECK = 1 << 20; // entries passed over in order between checks while building, at the least
+static const long long OUT_OF_CORE_MIN_CHECK = 1 << 10; // entries looked up out of order between checks, at the least
+
+// how the entries of a table on disk map to those of its coarse table
+static const int OUT_OF_CORE_ORIENTATION = 0; // by the orientations of the leading pieces
+static const int OUT_OF_CORE_PERMUTATION = 1; // by where the pieces numbered lowest are
+static const int OUT_OF_CORE_COMBINATION = 2; // by the labels in the leading positions
+
+// Complete tables published in shared memory for other ksolve processes
+static const unsigned long long SHARED_TABLE_MAGIC = 0x485365766c6f736bULL; // "ksolveSH"
+
+// Kinds of pruning table lookups done by prune()
+static const int PROBE_ORIENTATION_COMPLETE = 0;
+static const int PROBE_ORIENTATION_PARTIAL = 1;
+static const int PROBE_PERMUTATION_COMPLETE = 2; // unique permutation, indexed by pVector2Index
+static const int PROBE_PERMUTATION_COMBINATION = 3; // repeated pieces, indexed by pVector3Index
+static const int PROBE_PERMUTATION_PARTIAL = 4;
+static const int PROBE_DEPTHS = 32; // lookup statistics are kept per remaining depth; deeper ones share the last
+static const int PROBE_REORDER_INTERVAL = 4096; // evaluations at one depth between reorderings
+static const int PROBE_TIMING_SAMPLE = 64; // time the lookups of one evaluation in this many
+
+// Parallel search: subtrees below the root are handed to other threads as OpenMP tasks
+static const int SEARCH_TASK_MIN_DEPTH = 5; // least remaining depth of a subtree searched as a task
+static const int SEARCH_TASKS_PER_THREAD = 4; // tasks waiting per thread before children are searched in place
+static const int PARITY_MAX_SETS = 16; // sets tried for a parity of the solution length
+static const int BUDGET_CHECK_NODES = 4096; // nodes a thread searches between looks at the budget
+
+// Transposition table of subtrees that hold no solution. Entries are 64-bit words: the
+// high bits of the key, and the remaining depth + 1 in the low bits (0 if empty).
+static const int TRANSPOSITION_BUCKET = 4; // entries per bucket, 32 bytes
+static const int TRANSPOSITION_MIN_DEPTH = 3; // least remaining depth of a subtree looked up or stored
+static const unsigned long long TRANSPOSITION_DEPTH_MASK = 0xff;
+
+// Meet in the middle (-m): both halves of a solution are enumerated and joined by hash
+static const int MITM_MAX_HALF = 16; // most moves in one half
+static const int MITM_PARTITION_BITS = 6; // a half that outgrows memory is spilled to 64 files
+static const int MITM_READ_CHUNK = 65536; // records buffered or read from a spill file at a time
+
+// Two-phase solving: phase 1 reaches the def's Subgroup, phase 2 solves within it
+static const int TWOPHASE_MAX_FIRST = 20; // longest phase 1 tried
+static const int TWOPHASE_MAX_SECOND = 20; // longest phase 2 tried after one phase 1
+static const int TWOPHASE_CLOCK_INTERVAL = 4096; // phase 1 nodes between looks at the clock
+
+// Coordinate search: nodes are table indices, advanced by a move table per complete table
+static const long long COORDINATE_MAX_MOVE_TABLE = 1 << 25; // most entries (coordinates * moves) of one move table
+static const int COORDINATE_START_MS = 50; // time a depth takes with treeSolve before the move tables pay off
+
+// Blocked Bloom filters in front of partial tables. One block is a 64-byte cache line.
+static const int BLOOM_BLOCK_WORDS = 8; // 64-bit words per block
+static const int BLOOM_PROBES = 6; // bits set per key, all in the same block
+static const int BLOOM_BITS_PER_ENTRY = 10; // about 1% false positives
+
 // Some general data for a set of pieces
 struct dataset{
 	int type;
@@ -60,14 +154,49 @@ struct substate {
 };
 
 
+// what is kept in memory for a complete table that stays on disk
+struct outofcore {
+	int kind; // OUT_OF_CORE_*
+	int size; // pieces in the set
+	int omod;
+	int pieces; // leading pieces or positions the coarse table tells apart
+	long long block; // entries per coarse entry, for orientations
+	std::vector<long long> starts; // the first entry of each coarse entry, for combinations
+	std::vector<int> solved; // the labels, for combinations
+	std::vector<char> coarse; // the smallest depth of the positions of each coarse entry
+	std::atomic<long long> lookups; // coarse lookups, and how many of them cut off
+	std::atomic<long long> cuts;
+	std::mutex trimming; // held while the resident pages are checked
+};
+
+// a complete pruning table: one depth per index
+struct completetable {
+	char *data;
+	long long size; // number of entries, 0 if there is no table
+	int backing; // TABLE_BACKING_*
+	void *base; // what to release: the heap block or the start of the mapping
+	size_t length;
+	outofcore *disk; // for tables served from disk, else NULL
+	completetable() : data(NULL), size(0), backing(TABLE_BACKING_HEAP), base(NULL), length(0), disk(NULL) {}
+};
+
+// blocked Bloom filter for the keys of a partial pruning table
+struct bloomfilter {
+	std::vector<unsigned long long> words; // one spare block, so the blocks can start on a cache line
+	long long blocks; // 0 if no filter was built
+};
+
 // part of a pruning table
 struct subprune{
-	std::vector<char> orientation;
-	std::vector<char> permutation;
+	completetable orientation;
+	completetable permutation;
 	PARTIAL_TABLE_CONTAINER_TYPE partialorientation;
 	PARTIAL_TABLE_CONTAINER_TYPE partialpermutation;
 	int partialpermutation_depth;
 	int partialorientation_depth;
+	bloomfilter partialorientation_bloom;
+	bloomfilter partialpermutation_bloom;
+	std::vector<int> relabel; // label the permutation tables use for each label, if ignored pieces are collapsed
 };
 
 // some typedefs to make things easier
@@ -76,8 +205,77 @@ typedef std::vector<substate> Position;
 typedef std::map<int, std::set<int> > Block;
 typedef std::pair<int, int> MovePair;
 typedef std::map<int, subprune> PruneTable;
+
+// a Block as far as a pruning table over one set can check it
+struct blockrule {
+	std::vector<int> pieces; // of the set
+	int required; // 1 if they have to move, 0 if they have to stay, -1 if either, together
+};
+
+// what a pruning table over one set knows about the Blocks for one move
+struct moveblocks {
+	bool legal; // false if the move breaks a Block wherever the pieces of the set are
+	std::vector<int> touched; // positions in the set the move changes
+	std::vector<blockrule> rules;
+};
+
+#ifndef __EMSCRIPTEN__
+// tables being built in a background thread while the search runs
+struct backgroundtables {
+	std::thread thread;
+	std::mutex lock; // guards finished, log and remaining
+	PruneTable finished; // built, not yet taken by the search
+	string log; // what building them printed
+	int remaining; // tables not yet built
+	std::atomic<bool> stop;
+};
+#endif
+
+// one pruning table lookup
+struct pruneprobe {
+	int set;
+	int kind; // PROBE_*
+	int omod;
+	subprune *table;
+	long long disklookups; // of an out-of-core table, since its resident size was checked
+};
+
+// how one lookup has done at one depth
+struct probestats {
+	long long probes;
+	long long cutoffs;
+	long long timed;
+	double seconds; // of the timed probes
+};
+
+// the lookups prune() does against one set of tables, and the order to do them in
+struct probeset {
+	PruneTable *tables;
+	std::vector<pruneprobe> probes;
+	std::vector<std::vector<int> > order; // per depth, indices into probes
+	std::vector<std::vector<probestats> > stats; // per depth, per probe
+	std::vector<int> evaluations; // per depth, since the last reordering
+};
+
+// per-node copies of one set of pruning tables
+struct tablereplicas {
+	PruneTable *primary;
+	std::vector<PruneTable> nodes; // in the order of numaNodes
+};
 typedef std::map<int, dataset> PieceTypes;
 
+// Zobrist keys of the pieces and moves, and the transposition table they index
+struct transpositiontable {
+	std::vector<std::vector<unsigned long long> > permutationKeys; // per set: position * (size + 2) + label + 1
+	std::vector<std::vector<unsigned long long> > orientationKeys; // per set: position * (omod + 1) + orientation + 1
+	std::vector<int> orientationStride; // per set: omod + 1
+	std::vector<unsigned long long> moveKeys; // per move id + 1, of the move into a position
+	std::vector<std::vector<std::vector<int> > > changed; // per move id, per set: the positions it changes
+	std::vector<std::atomic<unsigned long long> > entries;
+	unsigned long long buckets; // a power of two
+	bool active; // used for the scramble being solved
+};
+
 // all the information needed to describe a possible move
 struct fullmove {
 	string name;
@@ -102,10 +300,165 @@ struct ScrambleDef {
 	int max_depth;
 	int slack;
 	int metric; // 0 = HTM, 1 = QTM
+	double twoPhase; // seconds to look for shorter two-phase solutions, or negative for the optimal search
+	double timeLimit; // seconds for the optimal search, or 0 for no limit
+	long long nodeLimit; // nodes for the optimal search, or 0 for no limit
+	bool fallback; // solve with two phases if the limits run out before a solution
 	int printState; // 0 = no, 1 = yes
 	std::vector<MoveLimit> moveLimits;
+	ScrambleDef() : max_depth(0), slack(0), metric(0), twoPhase(-1), timeLimit(0), nodeLimit(0), fallback(false), printState(0) {}
 };
 
 typedef std::map<int, fullmove> MoveList;
 
+// one half of a solution: the hash of the position where the halves meet, and the moves
+// of the half, as indices into the move list, in the order they are made
+struct mitmrecord {
+	unsigned long long hash;
+	unsigned char moves[MITM_MAX_HALF];
+};
+
+// the records of one half, in memory until there are budget of them, then in partition files
+struct mitmside {
+	std::vector<mitmrecord> records;
+	std::vector<FILE*> partitions; // by the high bits of the hash
+	long long budget;
+};
+
+// what the halves are compared on: the labels that the Ignore flags let trade places share
+// one label, and pieces whose orientation is ignored count as oriented
+struct mitmcanon {
+	std::vector<std::vector<int> > relabel; // per set, by label + 1
+	std::vector<std::vector<char> > free; // per set, by new label + 1: orientation ignored
+	Position target; // how every solved position looks after relabelling
+};
+
+// the def's Subgroup, and the puzzle as phase 1 of the two-phase solver sees it: only
+// the orbit of the subgroup a piece is in matters, and the orientations it can't change
+struct twophasepuzzle {
+	MoveList subgroup;
+	std::vector<std::vector<int> > relabel; // per set, by label: the orbit it is solved in, from 1
+	Position solved;
+	Position ignore;
+	PieceTypes datasets;
+	PruneTable tables;
+	probeset probes;
+	bool ready;
+};
+
+// the state of a two-phase search for one scramble
+struct twophasesearch {
+	ScrambleDef *scramble;
+	std::vector<MoveList::iterator> moves; // phase 1 makes all moves
+	std::vector<MoveList::iterator> subgroup; // phase 2 only those of the subgroup
+	std::vector<Position> first; // phase 1 positions, as phase 1 sees them, per level
+	std::vector<Position> second; // phase 2 positions per level, from where phase 1 ends
+	Position replay[2]; // for finding where phase 1 ends
+	std::vector<int> path; // move IDs, phase 1 then phase 2
+	std::vector<int> best; // the shortest solution so far
+	bool found;
+	probeset probes; // phase 2 lookups
+	clock_t start, deadline;
+	long long nodes;
+};
+
+// the state of a meet-in-the-middle search for one depth
+struct mitmsearch {
+	std::vector<MoveList::iterator> moves;
+	std::vector<int> inverse; // per move, the index of its inverse
+	mitmcanon canon;
+	std::vector<Position> states; // one per level of the enumeration
+	Position replay[2]; // for checking a joined solution
+	unsigned char path[MITM_MAX_HALF];
+	mitmside backward; // from the solved state, stored and sorted
+	mitmside forward; // from the scramble, joined as it is enumerated, unless backward was spilled
+};
+
+// a scramble searched as its inverse: the solutions found are turned back as they are reported
+struct inversesearch {
+	bool active;
+	Position original; // the scramble's own state, put back when it is solved
+	Position inverse;
+	std::map<string, string> names; // each move's name to that of its inverse
+};
+
+// the time and nodes the optimal search of a scramble may use
+struct searchbudget {
+	std::atomic<long long> nodes; // counted so far, by all threads
+	long long nodeLimit; // 0 for none
+	double deadline; // in probeClock() time, 0 for none
+	std::atomic<bool> exhausted;
+	bool active;
+};
+
+// a complete table looked up by its index alone, which a move table carries from node to node
+struct coordprobe {
+	int probe; // index into the probeset
+	int kind; // PROBE_ORIENTATION_COMPLETE, PROBE_PERMUTATION_COMPLETE or PROBE_PERMUTATION_COMBINATION
+	std::vector<int> *moves; // index after each move: index * moves + move
+	bool leaves; // solved positions of the scramble are 0 in the table, so it can check leaves too
+};
+
+// what a coordinate search of one scramble shares between its threads
+struct coordengine {
+	ScrambleDef *scramble;
+	Position *solved;
+	PieceTypes *datasets;
+	PruneTable *tables;
+	std::vector<MoveList::iterator> moves;
+	std::vector<int> cost; // per move, the depth it uses up
+	std::vector<char> allowed; // (previous move + 1) * moves + move: not a forbidden pair
+	std::vector<coordprobe> probes;
+	std::vector<char> coordinate; // per probe of the probeset: done by a coordprobe
+	std::vector<int> carried; // sets kept as states, for the lookups that are not coordinates
+	std::vector<int> root; // the indices of the scramble
+	int plies; // deepest level of the current search
+};
+
+// the state of one thread or task of a coordinate search, with room for every level
+struct coordsearch {
+	coordengine *engine;
+	probeset probes; // this thread's lookups that are not coordinates
+	std::vector<std::vector<int> > order; // the learned order of all lookups, for tasks
+	std::vector<char*> data; // per coordprobe, this thread's entries
+	std::vector<int> coords; // per level, per coordprobe
+	std::vector<int> children; // per level, the moves to the children of the node
+	std::vector<int> childCoords; // per level, per child, per coordprobe
+	std::vector<Position> states; // per level, with only the carried sets kept up to date
+	Position replay[2]; // for checking a leaf
+	std::vector<int> path; // indices into moves
+};
+
+// header of a pruning table file, followed by the section directory
+struct tablefileheader {
+	unsigned long long magic;
+	unsigned int version;
+	unsigned int sections;
+	unsigned long long fingerprint; // hash of everything the tables were built from
+	unsigned long long checksum; // hash of the section directory
+	char reserved[32];
+};
+
+// header of a shared table segment, followed by the entries
+struct sharedtableheader {
+	unsigned long long magic;
+	unsigned long long key; // tableKey of the table
+	long long size; // number of entries
+	unsigned long long checksum; // tableChecksum of the entries
+	volatile int ready; // set by the publisher once the entries are written
+	char reserved[28];
+};
+
+// one entry in the section directory
+struct tablesection {
+	int kind; // SECTION_*
+	unsigned long long offset; // from the start of the file, a multiple of TABLE_FILE_ALIGN
+	unsigned long long length; // in bytes
+	long long entries;
+	int keysize; // words per key, for partial tables
+	int depth; // largest depth in the table
+	unsigned long long checksum; // hash of the section contents
+	unsigned long long sums; // offset of the hash of each chunk, for complete tables
+};
+
 #endif
@@ -96,8 +96,11 @@ static bool godTable(Position& solved, MoveList& moves, PieceTypes& datasets, st
 	int dataStructure = 0; // 0 = array, 1 = map<longlong,char>,
 	                        // 2 = map<vector<longlong>,char>
 	signed char* distance = NULL;
+	int distanceBacking;
+	void *distanceBase = NULL;
+	size_t distanceLength;
 	if (logSize < 50 && totalSize <= maxmem)
-		distance = new (std::nothrow) signed char[(std::size_t) totalSize];
+		distance = (signed char*) allocateLarge(totalSize, distanceBacking, distanceBase, distanceLength);
 	std::map<long long, signed char> distMap1;
 	std::map<std::vector<long long>, signed char> distMap2;
 	long long i;
@@ -112,7 +115,7 @@ static bool godTable(Position& solved, MoveList& moves, PieceTypes& datasets, st
 			dataStructure = 1;
 		}
 	} else {
-		std::cout << "Allocated array of size " << totalSize << "\n";
+		std::cout << "Allocated array of size " << totalSize << " in " << backingName(distanceBacking) << "\n";
 		for (i=0; i<totalSize; i++) {
 			distance[i] = -1;
 		}
@@ -324,7 +327,7 @@ static bool godTable(Position& solved, MoveList& moves, PieceTypes& datasets, st
 				if (antiCnt >= antipodes) break;
 			}
 		}
-		delete []distance;
+		releaseLarge(distanceBacking, distanceBase, distanceLength);
 	} else if (dataStructure==1) {
 		std::map<long long, signed char>::iterator mapIter;
 		for (mapIter = distMap1.begin(); mapIter != distMap1.end(); mapIter++) {
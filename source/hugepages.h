@@ -0,0 +1,94 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for allocating large tables in huge pages. Pruning tables and the God's
+// algorithm distance array are probed at random, so with ordinary pages nearly every
+// probe misses the TLB. Large allocations try explicit huge pages (MAP_HUGETLB) first,
+// then transparent huge pages, then fall back to the heap.
+
+#ifndef HUGEPAGES_H
+#define HUGEPAGES_H
+
+// Whether transparent huge pages can be requested with madvise
+static bool transparentHugePages() {
+	static int available = -1;
+	if (available == -1) {
+		std::ifstream fin("/sys/kernel/mm/transparent_hugepage/enabled");
+		string mode;
+		std::getline(fin, mode);
+		available = fin.good() && mode.find("[never]") == string::npos;
+	}
+	return available == 1;
+}
+
+// Allocate size bytes. Sets backing to the TABLE_BACKING_* used, and base and
+// length to what has to be passed to releaseLarge.
+static char* allocateLarge(long long size, int& backing, void*& base, size_t& length) {
+	if (size >= HUGE_PAGE_SIZE) {
+		length = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			backing = TABLE_BACKING_HUGETLB;
+			return (char*) base;
+		}
+#ifdef MADV_HUGEPAGE
+		if (transparentHugePages()) {
+			// over-allocate so the table can start on a huge page boundary
+			char *region = (char*) mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (region != MAP_FAILED) {
+				char *aligned = (char*) (((unsigned long long) region + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+				if (aligned > region)
+					munmap(region, aligned - region);
+				if (region + HUGE_PAGE_SIZE > aligned)
+					munmap(aligned + length, region + HUGE_PAGE_SIZE - aligned);
+				if (madvise(aligned, length, MADV_HUGEPAGE) == 0) {
+					backing = TABLE_BACKING_TRANSPARENT;
+					base = aligned;
+					return aligned;
+				}
+				munmap(aligned, length);
+			}
+		}
+#endif
+	}
+	backing = TABLE_BACKING_HEAP;
+	base = new (std::nothrow) char[size];
+	length = size;
+	return (char*) base;
+}
+
+static void releaseLarge(int backing, void *base, size_t length) {
+	if (base == NULL)
+		return;
+	if (backing == TABLE_BACKING_HEAP)
+		delete[] (char*) base;
+	else
+		munmap(base, length);
+}
+
+static const char* backingName(int backing) {
+	switch (backing) {
+		case TABLE_BACKING_MAPPED: return "a shared mapping";
+		case TABLE_BACKING_HUGETLB: return "huge pages";
+		case TABLE_BACKING_TRANSPARENT: return "transparent huge pages";
+		default: return "ordinary pages";
+	}
+}
+
+#endif
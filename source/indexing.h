@@ -179,8 +179,35 @@ static long long pVector3Index(std::vector<int> permutation) {
 // Convert permutation array (non-unique) into an index
 static long long pVector3Index(int permutation[], unsigned int size) {
 	if (size < 2) return 0;
-	int index = 0;
-	
+	long long index = 0;
+
+	// small labels: count them in an array, as this is done for every table lookup
+	int small[PINDEX3_ARRAY_LABELS] = {0};
+	bool fits = true;
+	for (unsigned int i = 0; i < size && fits; i++) {
+		fits = permutation[i] >= 1 && permutation[i] < PINDEX3_ARRAY_LABELS;
+		if (fits)
+			small[permutation[i]]++;
+	}
+	if (fits && factorial(size) != -1) {
+		long long comb = factorial(size);
+		for (int label = 1; label < PINDEX3_ARRAY_LABELS; label++)
+			if (small[label] > 1)
+				comb /= factorial(small[label]);
+		unsigned int vecsize = size;
+		for (unsigned int ptr = 0; ptr < size; ptr++) {
+			// the combinations with a smaller label here, each a whole number
+			int below = 0;
+			for (int i=1; i < permutation[ptr]; i++)
+				below += small[i];
+			index += (comb * below)/vecsize;
+			comb = (comb * small[permutation[ptr]])/vecsize;
+			vecsize--;
+			small[permutation[ptr]]--;
+		}
+		return index;
+	}
+
 	// compute number of times each element appears
 	std::map<int, int> counts;
 	for (unsigned int i = 0; i < size; i++){
@@ -225,6 +252,40 @@ static int* pIndex3Array(long long index, std::vector<int> solved) {
 static int* pIndex3Array(long long index, int* solved, int size, int *vec=0) {
 	if (vec == 0)
 		vec = new int[size] ;
+
+	// small labels: as in pVector3Index, as tables on disk are built by decoding every index
+	int small[PINDEX3_ARRAY_LABELS] = {0};
+	bool fits = true;
+	for (int i = 0; i < size && fits; i++) {
+		fits = solved[i] >= 1 && solved[i] < PINDEX3_ARRAY_LABELS;
+		if (fits)
+			small[solved[i]]++;
+	}
+	if (fits && factorial(size) != -1) {
+		long long comb = factorial(size);
+		for (int label = 1; label < PINDEX3_ARRAY_LABELS; label++)
+			if (small[label] > 1)
+				comb /= factorial(small[label]);
+		int combsize = size;
+		for (int i = 0; i < size; i++) {
+			int label = 1;
+			for (; label < PINDEX3_ARRAY_LABELS; label++) {
+				if (small[label] > 0) {
+					long long num = (comb * small[label])/combsize;
+					if (num <= index)
+						index -= num;
+					else
+						break;
+				}
+			}
+			vec[i] = label;
+			comb = (comb * small[label])/combsize;
+			combsize--;
+			small[label]--;
+		}
+		return vec;
+	}
+
 	// compute number of times each element appears
 	std::map<int, int> counts;
 	std::map<int, int>::iterator iter;
@@ -318,6 +379,34 @@ static std::vector<long long> packVector(int vec[], int size){
 	return result;
 }
 
+// Mix one 64-bit word into a running hash
+static unsigned long long hashMix(unsigned long long h, unsigned long long word) {
+	h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static unsigned long long hashFinish(unsigned long long h) {
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
+
+// Hash a block of bytes, eight at a time
+static unsigned long long hashBytes(const char *data, long long length, unsigned long long seed) {
+	unsigned long long h = hashMix(seed, length);
+	long long i;
+	for (i = 0; i + 8 <= length; i += 8) {
+		unsigned long long word;
+		memcpy(&word, data + i, 8);
+		h = hashMix(h, word);
+	}
+	if (i < length) {
+		unsigned long long word = 0;
+		memcpy(&word, data + i, length - i);
+		h = hashMix(h, word);
+	}
+	return hashFinish(h);
+}
+
 static std::vector<int> unpackVector(std::vector<long long> vec, int newsize){
 	unsigned int size = vec.size();
 	std::vector<int> result (8*size);
@@ -0,0 +1,177 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for searching the inverse of a scramble. A sequence solves the scramble
+// exactly when its inverse, the moves reversed and each one inverted, solves the inverse
+// scramble, so both have the same solutions. The tables often see much more of one than
+// of the other, and the search takes the one they cut down the most.
+
+#ifndef INVERSE_H
+#define INVERSE_H
+
+static inversesearch& inverseSearch() {
+	static inversesearch search;
+	return search;
+}
+
+// Can the scramble be searched as its inverse? Every piece has to be told apart and
+// count, no move may depend on the position or on how often it was made, and every
+// move needs an inverse for the solutions to be turned back.
+static bool inverseUsable(ScrambleDef& scramble, MoveList& moves, PieceTypes& datasets, std::set<MovePair>& forbiddenPairs, std::vector<Block>& blocks) {
+	if (blocks.size() != 0 || scramble.moveLimits.size() != 0 || skipPrune)
+		return false;
+	for (unsigned int s = 0; s < scramble.state.size(); s++) {
+		if (!datasets[s].uniqueperm || !uniquePermutation(scramble.state[s].permutation, scramble.state[s].size))
+			return false;
+		for (int i = 0; i < scramble.state[s].size; i++) {
+			if (scramble.state[s].orientation[i] < 0 || scramble.state[s].orientation[i] >= datasets[s].omod)
+				return false;
+			if (scramble.ignore.size() != 0 && scramble.ignore[s].size > 0 && (scramble.ignore[s].permutation[i] != 0 || scramble.ignore[s].orientation[i] != 0))
+				return false;
+		}
+	}
+	std::set<MovePair>::iterator pair;
+	for (pair = forbiddenPairs.begin(); pair != forbiddenPairs.end(); pair++)
+		if (pair->first < 0 || pair->second < 0)
+			return false;
+	std::vector<MoveList::iterator> list;
+	std::vector<int> inverse;
+	return mitmMoves(moves, datasets, list, inverse);
+}
+
+// The inverse of state: if the moves of a sequence take solved to state, the same
+// sequence inverted takes solved to it
+static Position inversePosition(Position& state, Position& solved, PieceTypes& datasets) {
+	Position inverse(state.size());
+	for (unsigned int s = 0; s < state.size(); s++) {
+		int size = state[s].size;
+		int omod = datasets[s].omod;
+		inverse[s] = newSubstate(size);
+		// from[i]: the position in solved of the piece at i in state
+		std::vector<int> from(size), to(size);
+		for (int i = 0; i < size; i++)
+			for (int j = 0; j < size; j++)
+				if (solved[s].permutation[j] == state[s].permutation[i])
+					from[i] = j;
+		for (int i = 0; i < size; i++)
+			to[from[i]] = i;
+		for (int i = 0; i < size; i++) {
+			inverse[s].permutation[i] = solved[s].permutation[to[i]];
+			inverse[s].orientation[i] = ((solved[s].orientation[to[i]] + solved[s].orientation[i] - state[s].orientation[to[i]]) % omod + 2 * omod) % omod;
+		}
+	}
+	return inverse;
+}
+
+// The distances the tables give the positions within two moves of state, added up: a
+// sample of how much of the search from it they cut off, the more the larger it is
+static long long directionDistance(Position& state, std::vector<MoveList::iterator>& list, std::set<MovePair>& forbiddenPairs, PieceTypes& datasets, probeset& probes, int limit) {
+	Position first(state.size()), second(state.size());
+	for (unsigned int s = 0; s < state.size(); s++) {
+		first[s] = newSubstate(state[s].size);
+		second[s] = newSubstate(state[s].size);
+	}
+	long long distance = 0;
+	for (unsigned int m = 0; m < list.size(); m++) {
+		applyMove(state, first, list[m]->second.state, datasets);
+		distance += pruneDistance(first, probes, limit);
+		for (unsigned int n = 0; n < list.size(); n++) {
+			if (forbiddenPairs.find(MovePair(list[m]->first, list[n]->first)) != forbiddenPairs.end())
+				continue;
+			applyMove(first, second, list[n]->second.state, datasets);
+			distance += pruneDistance(second, probes, limit);
+		}
+	}
+	freePosition(first);
+	freePosition(second);
+	return distance;
+}
+
+// Pick the direction to search the scramble in, and return the depth to start at, the
+// most the tables give either direction, as both need the same number of moves. If the
+// inverse is picked, it becomes the scramble's state until endInverse, reversed gets the
+// forbidden pairs to search it with, and reportSolution turns its solutions back.
+static int chooseDirection(ScrambleDef& scramble, Position& solved, MoveList& moves, PieceTypes& datasets, probeset& probes, std::set<MovePair>& forbiddenPairs, std::vector<Block>& blocks, std::set<MovePair>& reversed) {
+	inversesearch& search = inverseSearch();
+	search.active = false;
+	int depth = pruneDistance(scramble.state, probes, scramble.max_depth + 1);
+	if (!inverseUsable(scramble, moves, datasets, forbiddenPairs, blocks))
+		return depth;
+
+	Position inverse = inversePosition(scramble.state, solved, datasets);
+	depth = std::max(depth, pruneDistance(inverse, probes, scramble.max_depth + 1));
+	std::vector<MoveList::iterator> list;
+	std::vector<int> inverses;
+	mitmMoves(moves, datasets, list, inverses);
+	std::map<int, int> inverseID;
+	for (unsigned int m = 0; m < list.size(); m++)
+		inverseID[list[m]->first] = list[inverses[m]]->first;
+	// a sequence is searched in one direction when its inverse is in the other
+	reversed.clear();
+	std::set<MovePair>::iterator pair;
+	for (pair = forbiddenPairs.begin(); pair != forbiddenPairs.end(); pair++) {
+		if (inverseID.count(pair->first) == 0 || inverseID.count(pair->second) == 0) {
+			freePosition(inverse);
+			return depth;
+		}
+		reversed.insert(MovePair(inverseID[pair->second], inverseID[pair->first]));
+	}
+
+	long long forward = directionDistance(scramble.state, list, forbiddenPairs, datasets, probes, scramble.max_depth + 1);
+	long long backward = directionDistance(inverse, list, reversed, datasets, probes, scramble.max_depth + 1);
+	if (backward <= forward) {
+		freePosition(inverse);
+		return depth;
+	}
+	search.active = true;
+	search.original = scramble.state;
+	search.inverse = inverse;
+	search.names.clear();
+	for (unsigned int m = 0; m < list.size(); m++)
+		search.names[list[m]->second.name] = list[inverses[m]]->second.name;
+	scramble.state = inverse;
+	std::cout << "Searching the inverse of the scramble.\n";
+	return depth;
+}
+
+// A solution of the inverse scramble as one of the scramble itself
+static string invertSequence(string& sequence) {
+	inversesearch& search = inverseSearch();
+	std::istringstream stream(sequence);
+	std::vector<string> names;
+	string name;
+	while (stream >> name)
+		names.push_back(name);
+	string inverted = " ";
+	for (int i = names.size() - 1; i >= 0; i--)
+		inverted += " " + search.names[names[i]];
+	return inverted;
+}
+
+// Put the scramble's own state back once its inverse has been searched
+static void endInverse(ScrambleDef& scramble) {
+	inversesearch& search = inverseSearch();
+	if (!search.active)
+		return;
+	scramble.state = search.original;
+	freePosition(search.inverse);
+	search.active = false;
+}
+
+#endif
@@ -20,20 +20,42 @@
 // Main struct and control flow of program, with all includes used in it
 
 #include <algorithm>
+#include <climits>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <queue>
 #include <set>
 #include <sstream>
 #include <stdlib.h>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#endif
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 #define PARTIAL_TABLE_CONTAINER map
@@ -86,11 +108,25 @@ std::string setnameFromIndex(int i) {
 }
 long long maxmem = 8000000000LL ;
 long long partPsize, partOsize;
-std::string nameSuffix = "";
+std::string tableCacheDir = "";
 int maxDepthMain=999;
-int solutionCountMain=0;
+std::atomic<int> solutionCountMain(0); // solutions found by all search threads
+std::atomic<bool> stopSearch(false); // set to make all search threads unwind
 int maxResultsMain=999;
+double timeLimitMain=0; // default TimeLimit of the scrambles
+long long nodeLimitMain=0; // default NodeLimit of the scrambles
 int skipPrune=0;
+int useBloom=0;
+int compressTables=0;
+int sharedTables=0;
+int hugeTables=0;
+int numaPlacement=0;
+int pinSearchThreads=0;
+int backgroundBuild=0;
+long long outOfCoreBudget=0;
+long long transpositionMegabytes=0;
+long long meetInMiddleMegabytes=0;
+std::string sharedTableDir = "/dev/shm";
 int verbose = 0 ;
 
 struct ksolve {
@@ -99,8 +135,20 @@ struct ksolve {
 	#include "blocks.h"
 	#include "checks.h"
 	#include "indexing.h"
+	#include "hugepages.h"
+	#include "bloom.h"
+	#include "tablefile.h"
+	#include "compress.h"
+	#include "sharing.h"
+	#include "numa.h"
+	#include "outofcore.h"
 	#include "pruning.h"
+	#include "transposition.h"
 	#include "search.h"
+	#include "coordinates.h"
+	#include "mitm.h"
+	#include "twophase.h"
+	#include "inverse.h"
 	#include "readdef.h"
 	#include "readscramble.h"
 	#include "god.h"
@@ -117,8 +165,21 @@ struct ksolve {
 				case 'd': maxDepthMain = atoi(argv[1]) ; argc-- ; argv++ ; break ;
 				case 'c': maxResultsMain = atoi(argv[1]) ; argc-- ; argv++ ; break ;
 				case 'M': maxmem = 1048576 * atoll(argv[1]) ; argc-- ; argv++ ; break ;
-				case 'P': partPsize = partOsize = 1048576 * atoll(argv[1]) ; nameSuffix = (std::string)"_"+argv[1]+"M"; argc-- ; argv++ ; break ;
+				case 'P': partPsize = partOsize = 1048576 * atoll(argv[1]) ; argc-- ; argv++ ; break ;
+				case 'T': tableCacheDir = argv[1] ; argc-- ; argv++ ; break ;
 				case 'p': skipPrune++ ; break;
+				case 'b': useBloom++ ; break;
+				case 'z': compressTables++ ; break;
+				case 'S': sharedTables++ ; break;
+				case 'H': hugeTables++ ; break;
+				case 'N': numaPlacement = (argv[1][0] == 'r') ? NUMA_REPLICATE : NUMA_INTERLEAVE ; argc-- ; argv++ ; break ;
+				case 'A': pinSearchThreads++ ; break;
+				case 'B': backgroundBuild++ ; break;
+				case 'O': outOfCoreBudget = 1048576 * atoll(argv[1]) ; argc-- ; argv++ ; break ;
+				case 'X': transpositionMegabytes = atoll(argv[1]) ; argc-- ; argv++ ; break ;
+				case 'm': meetInMiddleMegabytes = atoll(argv[1]) ; argc-- ; argv++ ; break ;
+				case 't': timeLimitMain = atof(argv[1]) ; argc-- ; argv++ ; break ;
+				case 'n': nodeLimitMain = atoll(argv[1]) ; argc-- ; argv++ ; break ;
 				case 'v': verbose++ ; break ;
 				default: std::cout << "Did not understand argument " << argv[0] << std::endl ;
 			}
@@ -145,19 +206,25 @@ struct ksolve {
 
 		string defFileName(argv[1]);
 		string scrambleFileName(argv[2]);
-		return ksolveWrapped(definitionStream, scrambleStream, defFileName, scrambleFileName, true);
+		if (tableCacheDir.empty()) { // default: next to the def file
+			size_t slash = defFileName.find_last_of("/\\");
+			tableCacheDir = (slash == string::npos ? string(".") : defFileName.substr(0, slash)) + "/ksolve-tables";
+		}
+		return ksolveWrapped(definitionStream, scrambleStream, scrambleFileName, true);
 
 	}
 
 	static int ksolveWrapped(std::istream &definitionStream,
 													 std::istream &scrambleStream,
-													 string defFileName,
 													 string scrambleFileName,
 													 bool usePruneTable)
 	{
 
 		clock_t start;
 		start = clock();
+		// tables are only kept on disk in the table cache
+		if (!usePruneTable)
+			outOfCoreBudget = 0;
 
 		// Load the puzzle rules
 		Rules ruleset(definitionStream);
@@ -167,6 +234,7 @@ struct ksolve {
 		std::set<MovePair> forbidden = ruleset.getForbiddenPairs();
 		Position ignore = ruleset.getIgnore();
 		std::vector<Block> blocks = ruleset.getBlocks();
+		twoPhasePuzzle().subgroup = ruleset.getSubgroup();
 		std::cout << "Ruleset loaded.\n";
 
 		// Print all generated moves
@@ -183,11 +251,17 @@ struct ksolve {
 		std::cout << ".\n";
 
 		// Compute or load the pruning tables
+		// (God's Algorithm does not use them, so they are never built in the background there)
 		PruneTable tables;
+		bool godMode = scrambleFileName == "!" || scrambleFileName == "!q";
 		if (!skipPrune) {
-			tables = getCompletePruneTables(solved, moves, datasets, ignore, defFileName, nameSuffix, usePruneTable);
+			tables = getCompletePruneTables(solved, moves, datasets, ignore, blocks, tableCacheDir, usePruneTable, backgroundBuild && !godMode);
 			std::cout << "Pruning tables loaded.\n";
 		} else std::cout << "Pruning tables skipped!\n";
+		if (pinSearchThreads)
+			pinThreads();
+		if (numaPlacement != NUMA_NONE && !skipPrune && !backgroundTablesPending())
+			placePruneTables(tables, numaPlacement);
 
 		//datasets = updateDatasets(datasets, tables);
 		updateDatasets(datasets, tables);
@@ -210,6 +284,8 @@ struct ksolve {
 		// Load the scramble to be solved
 		Scramble states(scrambleStream, solved, moves, datasets, blocks);
 		std::cout << "Scrambles loaded.\n";
+		if (transpositionMegabytes > 0)
+			initTranspositions(moves, datasets, transpositionMegabytes);
 
 		ScrambleDef scramble = states.getScramble();
 
@@ -248,28 +324,127 @@ struct ksolve {
 				moves2[iter2->first] = iter2->second;
 			}
 			processMoveLimits(moves2, scramble.moveLimits);
+			startTranspositions(scramble.moveLimits.size() == 0);
+			if (transpositionMegabytes > 0 && scramble.moveLimits.size() != 0)
+				std::cout << "Transposition table not used with move limits.\n";
+			bool meetInMiddle = meetInMiddleMegabytes > 0 && mitmUsable(scramble, moves2, datasets, blocks);
+
+			if (scramble.twoPhase >= 0 && twoPhaseUsable(scramble, blocks, "solving optimally")) {
+				twoPhaseSolve(scramble, solved, moves2, datasets, ignore, forbidden, usePruneTable);
+				std::cout << "\n";
+				scramble = states.getScramble();
+				continue;
+			}
+			startBudget(scramble.timeLimit, scramble.nodeLimit);
+
+			// With moves limited to zero, tables for just the moves that are left
+			// prune much better than the ones for all moves. In QTM, the tables are
+			// built over the quarter turns, so they count distances in QTM as well. A limit
+			// can leave a move without its inverse (R' but not R), so the tables get the
+			// inverses of the moves that are left too.
+			MoveList tableMoves = moves2;
+			MoveList allTableMoves = moves;
+			if (scramble.metric == 1) {
+				tableMoves = quarterTurns(moves, moves2);
+				allTableMoves = quarterTurns(moves, moves);
+			}
+			MoveList closedMoves;
+			bool restricted = tableMoves.size() < moves.size() && !skipPrune &&
+				inverseClosure(allTableMoves, tableMoves, datasets, closedMoves) && closedMoves.size() < moves.size();
+			PruneTable& searchTables = restricted ? restrictedPruneTables(solved, allTableMoves, closedMoves, datasets, ignore, blocks, tableCacheDir, usePruneTable) : tables;
+			PieceTypes searchDatasets = datasets;
+			updateDatasets(searchDatasets, searchTables);
 
-			std::cout << "Depth 0, time to here " << (clock() - start) / (double)CLOCKS_PER_SEC << "s\n";
+			// The tree-search for the solution(s)
+			probeset probes = pruneProbes(searchDatasets, searchTables);
+			coordengine coordinates;
+			bool useCoordinates = false;
+			bool coordinatesTried = false;
+			clock_t depthTime = 0;
+
+			// start at the depth the tables give the scramble or its inverse, searching the
+			// one they cut more of, and when every solution has the same parity of length,
+			// skip the depths of the other parity
+			std::set<MovePair> reversedForbidden;
+			depth = chooseDirection(scramble, solved, moves2, searchDatasets, probes, forbidden, blocks, reversedForbidden);
+			std::set<MovePair>& searchForbidden = inverseSearch().active ? reversedForbidden : forbidden;
+			int parity = solutionParity(scramble, solved, moves2, datasets);
+			if (parity >= 0 && depth % 2 != parity)
+				depth++;
+			std::cout << "Depth " << depth << ", time to here " << (clock() - start) / (double)CLOCKS_PER_SEC << "s\n";
 			clock_t start2 = clock();
+			if (depth > scramble.max_depth)
+				std::cout << "\nMax depth reached, aborting.\n";
 
-
-			// The tree-search for the solution(s)
-			int usedSlack = 0;
+			int solvedDepth = -1;
 			solutionCountMain=0;
-			while(solutionCountMain<maxResultsMain) {
-				solutionCountMain=0;
-				bool foundSolution = treeSolve(scramble.state, solved, moves, datasets, tables, forbidden, scramble.ignore, blocks, depth, scramble.metric, scramble.moveLimits, temp_a, -1, true);
-				if (foundSolution || usedSlack > 0) {
-					usedSlack++;
-					if (usedSlack > scramble.slack) break;
+			while(solutionCountMain<maxResultsMain && depth <= scramble.max_depth) {
+				// switch to tables finished in the background since the last depth
+				if (takeBackgroundTables(tables)) {
+					if (numaPlacement != NUMA_NONE && !backgroundTablesPending())
+						placePruneTables(tables, numaPlacement);
+					updateDatasets(datasets, tables);
+					if (!restricted) {
+						searchDatasets = datasets;
+						probes = pruneProbes(searchDatasets, tables);
+						if (coordinatesTried)
+							useCoordinates = coordPrepare(coordinates, scramble, solved, moves2, searchDatasets, probes, searchForbidden, ignore, blocks);
+						std::cout << "Using newly built pruning tables from depth " << depth << ".\n";
+					}
 				}
-				depth++;
+				// building the move tables costs more than a shallow search, so the
+				// coordinate search takes over once a depth takes a while
+				if (!coordinatesTried && depthTime >= COORDINATE_START_MS * (CLOCKS_PER_SEC / 1000)) {
+					coordinatesTried = true;
+					useCoordinates = coordPrepare(coordinates, scramble, solved, moves2, searchDatasets, probes, searchForbidden, ignore, blocks);
+				}
+				clock_t depthStart = clock();
+				solutionCountMain=0;
+				stopSearch=false;
+				searchExcess() = INT_MAX;
+				bool foundSolution;
+				if (meetInMiddle && depth <= 2 * MITM_MAX_HALF)
+					foundSolution = mitmSolve(scramble, solved, moves2, searchDatasets, probes, searchForbidden, depth, meetInMiddleMegabytes);
+				else if (useCoordinates)
+					foundSolution = coordSolve(coordinates, probes, depth);
+				else
+					foundSolution = treeSolve(scramble.state, solved, moves2, searchDatasets, probes, searchForbidden, scramble.ignore, blocks, depth, scramble.metric, scramble.moveLimits, temp_a, -1, transpositionHash(scramble.state), true);
+				depthTime = clock() - depthStart;
+				if (foundSolution && solvedDepth < 0)
+					solvedDepth = depth;
+				if (budgetExhausted())
+					break;
+
+				// the next depth is the least one the cut off nodes could fit in
+				depth += (searchExcess() == INT_MAX) ? 1 : searchExcess().load();
+				if (parity >= 0 && depth % 2 != parity)
+					depth++;
+				if (solvedDepth >= 0 && depth > solvedDepth + scramble.slack) break;
 				if (depth > scramble.max_depth){
 					std::cout << "\nMax depth reached, aborting.\n";
 					break;
 				}
 				std::cout << "Depth " << depth << ", time " << (clock() - start2) / (double)CLOCKS_PER_SEC << "s\n";
 			}
+			endInverse(scramble);
+
+			// out of time or nodes: say how far the search got, and maybe solve it suboptimally
+			if (budgetExhausted()) {
+				searchbudget& budget = searchBudget();
+				bool timeUp = budget.deadline > 0 && probeClock() >= budget.deadline;
+				std::cout << "\n" << (timeUp ? "Time" : "Node") << " limit reached at depth " << depth << " after " << budget.nodes << " nodes";
+				if (solvedDepth < 0)
+					std::cout << "; there is no solution of fewer than " << depth << " moves";
+				std::cout << ".\n";
+				if (solvedDepth < 0 && scramble.fallback && twoPhaseUsable(scramble, blocks, "no fallback")) {
+					std::cout << "Solving in two phases instead.\n";
+					double seconds = scramble.twoPhase;
+					scramble.twoPhase = 0;
+					twoPhaseSolve(scramble, solved, moves2, datasets, ignore, forbidden, usePruneTable);
+					scramble.twoPhase = seconds;
+				}
+			}
+			searchBudget().active = false;
 			std::cout << "\n";
 
 			scramble = states.getScramble();
@@ -277,6 +452,14 @@ struct ksolve {
 
 		std::cout << "Total time: " << (clock() - start) / (double)CLOCKS_PER_SEC << "s\n";
 
+		stopBackgroundTables();
+		reportOutOfCore(tables);
+		std::map<std::set<int>, PruneTable>::iterator restricted;
+		for (restricted = restrictedTables().begin(); restricted != restrictedTables().end(); restricted++)
+			reportOutOfCore(restricted->second);
+		releaseReplicas();
+		releasePruneTables(tables);
+		releaseRestrictedTables();
 		return EXIT_SUCCESS;
 	}
 };
@@ -288,5 +471,5 @@ int main(int argc, char *argv[]) {
 extern "C" void solve(char* definition, char* state) {
 	std::istringstream definitionStream(definition);
 	std::istringstream scrambleStream(state);
-	ksolve::ksolveWrapped(definitionStream, scrambleStream, "dummy", "dummy", false);
+	ksolve::ksolveWrapped(definitionStream, scrambleStream, "dummy", false);
 }
@@ -0,0 +1,356 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for the meet-in-the-middle search. For a depth d, every sequence of d/2 moves
+// into the solved state is stored by the position it starts from, and every sequence of
+// the other (d+1)/2 moves from the scramble is looked up by the position it ends in, so
+// the work is about the square root of a tree search that can't prune. Within a depth,
+// solutions come out in no particular order.
+
+#ifndef MITM_H
+#define MITM_H
+
+// Can this scramble be solved by meeting in the middle? Blocks and MoveLimits depend on
+// the moves made before, which the half from the solved state doesn't know.
+static bool mitmUsable(ScrambleDef& scramble, MoveList& moves, PieceTypes& datasets, std::vector<Block>& blocks) {
+	std::vector<MoveList::iterator> list;
+	std::vector<int> inverse;
+	if (blocks.size() != 0)
+		std::cout << "Meet in the middle can't be used with Blocks, using the tree search.\n";
+	else if (scramble.moveLimits.size() != 0)
+		std::cout << "Meet in the middle can't be used with MoveLimits, using the tree search.\n";
+	else if (scramble.metric == 1)
+		std::cout << "Meet in the middle can't be used in QTM, using the tree search.\n";
+	else if (moves.size() > 256)
+		std::cout << "Too many moves for meet in the middle, using the tree search.\n";
+	else if (!mitmMoves(moves, datasets, list, inverse))
+		std::cout << "Not every move has an inverse, so meet in the middle can't be used.\n";
+	else
+		return true;
+	return false;
+}
+
+// The moves as a list, and for each the index of its inverse; false if one has none
+static bool mitmMoves(MoveList& moves, PieceTypes& datasets, std::vector<MoveList::iterator>& list, std::vector<int>& inverse) {
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++)
+		list.push_back(iter);
+	inverse.assign(list.size(), -1);
+
+	Position identity(datasets.size()), once(datasets.size()), twice(datasets.size());
+	for (unsigned int s = 0; s < datasets.size(); s++) {
+		identity[s] = newSubstate(datasets[s].size);
+		once[s] = newSubstate(datasets[s].size);
+		twice[s] = newSubstate(datasets[s].size);
+		for (int i = 0; i < datasets[s].size; i++) {
+			identity[s].permutation[i] = i + 1;
+			identity[s].orientation[i] = 0;
+		}
+	}
+	bool complete = true;
+	for (unsigned int m = 0; m < list.size(); m++) {
+		applyMove(identity, once, list[m]->second.state, datasets);
+		for (unsigned int n = 0; n < list.size() && inverse[m] < 0; n++) {
+			applyMove(once, twice, list[n]->second.state, datasets);
+			if (isEqual(twice, identity, datasets))
+				inverse[m] = n;
+		}
+		complete = complete && inverse[m] >= 0;
+	}
+	freePosition(identity);
+	freePosition(once);
+	freePosition(twice);
+	return complete;
+}
+
+// moves and the inverse of each of them from allMoves, in closed; false if one has none.
+// Tables are built from the solved state, so they give distances with the inverses of
+// their moves, and bound a search with the moves only when the inverses are among them.
+static bool inverseClosure(MoveList& allMoves, MoveList& moves, PieceTypes& datasets, MoveList& closed) {
+	std::vector<MoveList::iterator> list;
+	std::vector<int> inverse;
+	mitmMoves(allMoves, datasets, list, inverse);
+	closed = moves;
+	for (unsigned int m = 0; m < list.size(); m++) {
+		if (moves.count(list[m]->first) == 0)
+			continue;
+		if (inverse[m] < 0)
+			return false;
+		closed[list[inverse[m]]->first] = list[inverse[m]]->second;
+	}
+	return true;
+}
+
+// Pieces the Ignore flags let end up anywhere (there are more of their label than the
+// positions that are checked need) share one new label. Where an orientation is ignored,
+// the label found there is treated as always oriented. Every solved position then relabels
+// to the same target, and so does every position a sequence of moves turns into one.
+static mitmcanon mitmCanonical(Position& scramble, Position& solved, Position& ignore, PieceTypes& datasets) {
+	mitmcanon canon;
+	int sets = solved.size();
+	canon.relabel.resize(sets);
+	canon.free.resize(sets);
+	canon.target.resize(sets);
+	for (int s = 0; s < sets; s++) {
+		int size = solved[s].size;
+		bool wholeSet = ignore.size() != 0 && (s >= (int) ignore.size() || ignore[s].size == 0);
+		std::vector<char> permIgnored(size, wholeSet), orientIgnored(size, wholeSet);
+		if (!wholeSet && ignore.size() != 0)
+			for (int i = 0; i < size; i++) {
+				permIgnored[i] = ignore[s].permutation[i] != 0;
+				orientIgnored[i] = ignore[s].orientation[i] != 0;
+			}
+
+		int shared = 0;
+		for (int i = 0; i < size; i++)
+			shared = std::max(shared, std::max(solved[s].permutation[i], scramble[s].permutation[i]));
+		shared++;
+		std::vector<int> supply(shared + 2, 0), demand(shared + 2, 0);
+		for (int i = 0; i < size; i++) {
+			supply[scramble[s].permutation[i] + 1]++;
+			if (!permIgnored[i])
+				demand[solved[s].permutation[i] + 1]++;
+		}
+		std::vector<int>& relabel = canon.relabel[s];
+		relabel.resize(shared + 2);
+		for (int label = -1; label <= shared; label++)
+			relabel[label + 1] = (label == shared || supply[label + 1] > demand[label + 1]) ? shared : label;
+
+		substate& target = canon.target[s];
+		target = newSubstate(size);
+		canon.free[s].assign(shared + 2, 0);
+		for (int i = 0; i < size; i++) {
+			target.permutation[i] = permIgnored[i] ? shared : relabel[solved[s].permutation[i] + 1];
+			if (orientIgnored[i] || datasets[s].omod == 1)
+				canon.free[s][target.permutation[i] + 1] = 1;
+		}
+		for (int i = 0; i < size; i++)
+			target.orientation[i] = canon.free[s][target.permutation[i] + 1] ? 0 : solved[s].orientation[i];
+	}
+	return canon;
+}
+
+// Hash of a position as the join compares it
+static unsigned long long mitmHash(Position& state, mitmcanon& canon) {
+	unsigned long long h = 0;
+	for (unsigned int s = 0; s < state.size(); s++) {
+		std::vector<int>& relabel = canon.relabel[s];
+		std::vector<char>& free = canon.free[s];
+		for (int i = 0; i < state[s].size; i++) {
+			int label = relabel[state[s].permutation[i] + 1];
+			int orientation = free[label + 1] ? 0 : state[s].orientation[i];
+			h = hashMix(h, ((unsigned long long) label << 32) | orientation);
+		}
+	}
+	return hashFinish(h);
+}
+
+static bool mitmLess(const mitmrecord& a, const mitmrecord& b) {
+	return a.hash < b.hash;
+}
+
+// Store a record, spilling the side to its partition files when it reaches its budget
+static void mitmAdd(mitmside& side, mitmrecord& record) {
+	side.records.push_back(record);
+	if ((long long) side.records.size() >= side.budget)
+		mitmSpill(side);
+}
+
+static void mitmSpill(mitmside& side) {
+	if (side.partitions.empty()) {
+		for (int p = 0; p < 1 << MITM_PARTITION_BITS; p++) {
+			FILE *file = tmpfile();
+			if (file == NULL) {
+				std::cout << "Can't create a file to spill the meet in the middle search to!\n";
+				exit(-1);
+			}
+			side.partitions.push_back(file);
+		}
+	}
+	for (unsigned int r = 0; r < side.records.size(); r++) {
+		FILE *file = side.partitions[side.records[r].hash >> (64 - MITM_PARTITION_BITS)];
+		if (fwrite(&side.records[r], sizeof(mitmrecord), 1, file) != 1) {
+			std::cout << "Can't write the meet in the middle spill file!\n";
+			exit(-1);
+		}
+	}
+	side.records.clear();
+}
+
+static void mitmClose(mitmside& side) {
+	for (unsigned int p = 0; p < side.partitions.size(); p++)
+		fclose(side.partitions[p]);
+	side.partitions.clear();
+}
+
+// All sequences of depth - level more moves into the solved state. They are found by
+// making the inverse moves from it, in reverse order; the pairs that are forbidden are
+// those of the moves undone.
+static void mitmBackward(mitmsearch& search, PieceTypes& datasets, std::set<MovePair>& forbiddenPairs, int level, int depth) {
+	Position& state = search.states[level];
+	countNode();
+	if (level == depth) {
+		mitmrecord record;
+		record.hash = mitmHash(state, search.canon);
+		for (int i = 0; i < depth; i++)
+			record.moves[i] = search.inverse[search.path[depth - 1 - i]];
+		mitmAdd(search.backward, record);
+		return;
+	}
+	for (unsigned int m = 0; m < search.moves.size() && !searchStopped(); m++) {
+		if (level > 0) {
+			int undone = search.moves[search.inverse[m]]->first;
+			int after = search.moves[search.inverse[search.path[level - 1]]]->first;
+			if (forbiddenPairs.find(MovePair(undone, after)) != forbiddenPairs.end())
+				continue;
+		}
+		applyMove(state, search.states[level + 1], search.moves[m]->second.state, datasets);
+		search.path[level] = m;
+		mitmBackward(search, datasets, forbiddenPairs, level + 1, depth);
+	}
+}
+
+// All sequences of half moves from the scramble that the pruning tables allow to be
+// finished in depth moves. Each is joined with the stored half, or written to the
+// partition files if the stored half was spilled.
+static void mitmForward(mitmsearch& search, ScrambleDef& scramble, Position& solved, PieceTypes& datasets, probeset& probes, std::set<MovePair>& forbiddenPairs, int level, int half, int depth, int old_move) {
+	Position& state = search.states[level];
+	countNode();
+	if (level == half) {
+		mitmrecord record;
+		record.hash = mitmHash(state, search.canon);
+		memcpy(record.moves, search.path, half);
+		if (search.backward.partitions.empty())
+			mitmJoin(search, scramble, solved, datasets, forbiddenPairs, record, half, depth, search.backward.records);
+		else
+			mitmAdd(search.forward, record);
+		return;
+	}
+	for (unsigned int m = 0; m < search.moves.size() && !searchStopped(); m++) {
+		if (forbiddenPairs.find(MovePair(old_move, search.moves[m]->first)) != forbiddenPairs.end())
+			continue;
+		applyMove(state, search.states[level + 1], search.moves[m]->second.state, datasets);
+		if (!skipPrune && prune(search.states[level + 1], depth - level - 1, probes))
+			continue;
+		search.path[level] = m;
+		mitmForward(search, scramble, solved, datasets, probes, forbiddenPairs, level + 1, half, depth, search.moves[m]->first);
+	}
+}
+
+// Report every stored half, of the sorted records, that finishes the half from the scramble
+static void mitmJoin(mitmsearch& search, ScrambleDef& scramble, Position& solved, PieceTypes& datasets, std::set<MovePair>& forbiddenPairs, mitmrecord& forward, int half, int depth, std::vector<mitmrecord>& stored) {
+	std::pair<std::vector<mitmrecord>::iterator, std::vector<mitmrecord>::iterator> range;
+	range = std::equal_range(stored.begin(), stored.end(), forward, mitmLess);
+	for (std::vector<mitmrecord>::iterator iter = range.first; iter != range.second && !searchStopped(); iter++) {
+		if (half > 0 && depth > half) {
+			MovePair junction(search.moves[forward.moves[half - 1]]->first, search.moves[iter->moves[0]]->first);
+			if (forbiddenPairs.find(junction) != forbiddenPairs.end())
+				continue;
+		}
+		// the hashes match; make sure the positions do
+		std::vector<int> sequence(forward.moves, forward.moves + half);
+		sequence.insert(sequence.end(), iter->moves, iter->moves + depth - half);
+		Position *from = &scramble.state;
+		for (unsigned int i = 0; i < sequence.size(); i++) {
+			applyMove(*from, search.replay[i % 2], search.moves[sequence[i]]->second.state, datasets);
+			from = &search.replay[i % 2];
+		}
+		if (!isSolved(*from, solved, scramble.ignore, datasets))
+			continue;
+		string text = " ";
+		for (unsigned int i = 0; i < sequence.size(); i++)
+			text += " " + search.moves[sequence[i]]->second.name;
+		reportSolution(text);
+	}
+}
+
+// Join the halves one partition at a time, each small enough to sort in memory
+static void mitmJoinPartitions(mitmsearch& search, ScrambleDef& scramble, Position& solved, PieceTypes& datasets, std::set<MovePair>& forbiddenPairs, int half, int depth) {
+	std::vector<mitmrecord> stored, chunk(MITM_READ_CHUNK);
+	for (unsigned int p = 0; p < search.backward.partitions.size() && !searchStopped(); p++) {
+		FILE *file = search.backward.partitions[p];
+		fseek(file, 0, SEEK_END);
+		stored.resize(ftell(file) / sizeof(mitmrecord));
+		rewind(file);
+		if (stored.size() > 0 && fread(stored.data(), sizeof(mitmrecord), stored.size(), file) != stored.size()) {
+			std::cout << "Can't read the meet in the middle spill file!\n";
+			exit(-1);
+		}
+		std::sort(stored.begin(), stored.end(), mitmLess);
+
+		file = search.forward.partitions[p];
+		rewind(file);
+		size_t count;
+		while ((count = fread(chunk.data(), sizeof(mitmrecord), chunk.size(), file)) > 0 && !searchStopped())
+			for (size_t r = 0; r < count; r++)
+				mitmJoin(search, scramble, solved, datasets, forbiddenPairs, chunk[r], half, depth, stored);
+	}
+}
+
+// Search for solutions of exactly depth moves by meeting in the middle, keeping at most
+// megabytes MB of the stored half in memory
+static bool mitmSolve(ScrambleDef& scramble, Position& solved, MoveList& moves, PieceTypes& datasets, probeset& probes, std::set<MovePair>& forbiddenPairs, int depth, long long megabytes) {
+	if (!skipPrune && prune(scramble.state, depth, probes))
+		return false;
+	mitmsearch search;
+	mitmMoves(moves, datasets, search.moves, search.inverse);
+	search.canon = mitmCanonical(scramble.state, solved, scramble.ignore, datasets);
+	int half = (depth + 1) / 2; // from the scramble; the rest is stored
+	search.states.resize(half + 1);
+	for (int level = 0; level <= half; level++)
+		search.states[level] = copyPosition(solved);
+	search.replay[0] = copyPosition(solved);
+	search.replay[1] = copyPosition(solved);
+	search.backward.budget = std::max(1LL, megabytes * 1048576 / (long long) sizeof(mitmrecord));
+	search.forward.budget = MITM_READ_CHUNK;
+	int found = solutionCountMain;
+
+	for (unsigned int s = 0; s < solved.size(); s++) {
+		memcpy(search.states[0][s].permutation, search.canon.target[s].permutation, solved[s].size*sizeof(int));
+		memcpy(search.states[0][s].orientation, search.canon.target[s].orientation, solved[s].size*sizeof(int));
+	}
+	mitmBackward(search, datasets, forbiddenPairs, 0, depth - half);
+	if (search.backward.partitions.empty()) {
+		std::sort(search.backward.records.begin(), search.backward.records.end(), mitmLess);
+	} else {
+		mitmSpill(search.backward);
+		std::cout << "More than " << megabytes << " MB of positions at depth " << depth - half << ", spilled to disk.\n";
+	}
+
+	for (unsigned int s = 0; s < solved.size(); s++) {
+		memcpy(search.states[0][s].permutation, scramble.state[s].permutation, solved[s].size*sizeof(int));
+		memcpy(search.states[0][s].orientation, scramble.state[s].orientation, solved[s].size*sizeof(int));
+	}
+	mitmForward(search, scramble, solved, datasets, probes, forbiddenPairs, 0, half, depth, -1);
+	if (!search.backward.partitions.empty()) {
+		mitmSpill(search.forward);
+		mitmJoinPartitions(search, scramble, solved, datasets, forbiddenPairs, half, depth);
+	}
+
+	mitmClose(search.backward);
+	mitmClose(search.forward);
+	for (int level = 0; level <= half; level++)
+		freePosition(search.states[level]);
+	freePosition(search.replay[0]);
+	freePosition(search.replay[1]);
+	freePosition(search.canon.target);
+	return solutionCountMain > found;
+}
+
+#endif
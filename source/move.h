@@ -24,28 +24,30 @@
 
 // faster version of original applyMove
 static void applyMove(Position& state, Position& new_state, Position& move, PieceTypes& datasets){
-	Position::iterator iter;
-        for (int iter=0; iter<move.size(); iter++) {
-		int size = move[iter].size;
-		int omod = datasets[iter].omod;
-		int* orientOut = new_state[iter].orientation;
-		int* permute1 = state[iter].permutation;
-		int* permute2 = move[iter].permutation;
-		int* permuteOut = new_state[iter].permutation;
-		
-		if (omod == 1) {
-			for (int i=0; i < size; i++) {
-				orientOut[i] = 0;
-				permuteOut[i] = permute1[permute2[i] - 1];
-			}
-		} else {
-			int* orient1 = state[iter].orientation;
-			int* orient2 = move[iter].orientation;
-			for (int i=0; i < size; i++) {
-				int permuted = permute2[i] - 1;
-				orientOut[i] = (orient1[permuted] + orient2[permuted]) % omod;
-				permuteOut[i] = permute1[permuted];
-			}
+	for (int iter=0; iter<move.size(); iter++)
+		applySubstateMove(state[iter], new_state[iter], move[iter], datasets[iter].omod);
+}
+
+// apply the move of one set of pieces
+static void applySubstateMove(substate& state, substate& new_state, substate& move, int omod){
+	int size = move.size;
+	int* orientOut = new_state.orientation;
+	int* permute1 = state.permutation;
+	int* permute2 = move.permutation;
+	int* permuteOut = new_state.permutation;
+
+	if (omod == 1) {
+		for (int i=0; i < size; i++) {
+			orientOut[i] = 0;
+			permuteOut[i] = permute1[permute2[i] - 1];
+		}
+	} else {
+		int* orient1 = state.orientation;
+		int* orient2 = move.orientation;
+		for (int i=0; i < size; i++) {
+			int permuted = permute2[i] - 1;
+			orientOut[i] = (orient1[permuted] + orient2[permuted]) % omod;
+			permuteOut[i] = permute1[permuted];
 		}
 	}
 }
@@ -159,6 +161,21 @@ static bool moveIn(string name, MoveList& moves) {
 	return false;
 }
 
+// The quarter turns making up the moves in moves: the moves of allMoves with a qtm of 1
+// whose parent has a move in moves. Every move is its qtm of them in a row, so tables
+// built over them count distances in QTM.
+static MoveList quarterTurns(MoveList& allMoves, MoveList& moves) {
+	std::set<int> parents;
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++)
+		parents.insert(iter->second.parentID);
+	MoveList quarters;
+	for (iter = allMoves.begin(); iter != allMoves.end(); iter++)
+		if (iter->second.qtm == 1 && parents.count(iter->second.parentID) > 0)
+			quarters[iter->first] = iter->second;
+	return quarters;
+}
+
 static void processMoveLimits(MoveList& moves, std::vector<MoveLimit> limits) {
 	unsigned int i;
 	MoveList::iterator iter;
@@ -0,0 +1,229 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for placing pruning tables on NUMA nodes. Tables are first touched by the
+// thread that loads them, so on a machine with several nodes every lookup from a thread
+// on another node is a remote memory access. Tables can instead be interleaved over all
+// nodes, or replicated so every node has its own copy of the tables small enough to
+// duplicate; treeSolve threads then use the copy of the node they run on.
+
+#ifndef NUMA_H
+#define NUMA_H
+
+// "0-3,8-11" to 0 1 2 3 8 9 10 11
+static std::vector<int> parseCpuList(string list) {
+	std::vector<int> cpus;
+	std::istringstream in(list);
+	string range;
+	while (std::getline(in, range, ',')) {
+		int first, last;
+		if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+			for (int cpu = first; cpu <= last; cpu++)
+				cpus.push_back(cpu);
+		} else if (sscanf(range.c_str(), "%d", &first) == 1) {
+			cpus.push_back(first);
+		}
+	}
+	return cpus;
+}
+
+// CPUs of each NUMA node, by node number; empty unless there are several nodes
+static std::map<int, std::vector<int> >& numaNodes() {
+	static std::map<int, std::vector<int> > nodes;
+	static bool read = false;
+	if (!read) {
+		read = true;
+		for (int node = 0; node < NUMA_MAX_NODES; node++) {
+			char name[64];
+			sprintf(name, "/sys/devices/system/node/node%d/cpulist", node);
+			std::ifstream fin(name);
+			string list;
+			if (std::getline(fin, list) && !parseCpuList(list).empty())
+				nodes[node] = parseCpuList(list);
+		}
+		if (nodes.size() < 2)
+			nodes.clear();
+	}
+	return nodes;
+}
+
+// Index of the node (in numaNodes order) of a CPU, or -1
+static int numaNodeIndex(int cpu) {
+	std::map<int, std::vector<int> >& nodes = numaNodes();
+	std::map<int, std::vector<int> >::iterator iter;
+	int index = 0;
+	for (iter = nodes.begin(); iter != nodes.end(); iter++, index++)
+		if (std::find(iter->second.begin(), iter->second.end(), cpu) != iter->second.end())
+			return index;
+	return -1;
+}
+
+// Memory policy of the calling thread: mode is MPOL_*, nodes the node numbers it applies to
+static bool setMemoryPolicy(int mode, std::vector<int> nodes) {
+#ifdef __linux__
+	unsigned long mask[NUMA_MAX_NODES / (8*sizeof(unsigned long))];
+	memset(mask, 0, sizeof(mask));
+	for (unsigned int i = 0; i < nodes.size(); i++)
+		mask[nodes[i] / (8*sizeof(unsigned long))] |= 1UL << (nodes[i] % (8*sizeof(unsigned long)));
+	return syscall(SYS_set_mempolicy, mode, mode == MPOL_DEFAULT ? NULL : mask, NUMA_MAX_NODES + 1) == 0;
+#else
+	return false;
+#endif
+}
+
+// Copy tables; complete tables up to limit bytes get new memory, larger ones and those
+// on disk are shared with the original. Memory is placed according to the calling thread's policy.
+static void copyPruneTables(PruneTable& from, PruneTable& to, long long limit) {
+	PruneTable::iterator iter;
+	for (iter = from.begin(); iter != from.end(); iter++) {
+		subprune& sub = to[iter->first];
+		sub = iter->second;
+		completetable *tables[2] = {&sub.permutation, &sub.orientation};
+		for (int i = 0; i < 2; i++) {
+			completetable& table = *tables[i];
+			if (table.size == 0 || table.size > limit || table.disk != NULL)
+				continue;
+			char *data = table.data;
+			table.data = allocateLarge(table.size, table.backing, table.base, table.length);
+			if (table.data == NULL) {
+				std::cerr << "Could not allocate a pruning table of size " << table.size << "\n";
+				exit(-1);
+			}
+			memcpy(table.data, data, table.size);
+		}
+	}
+}
+
+// Release the copies made by copyPruneTables, but not what they share with the original
+static void releaseCopiedTables(PruneTable& copy, PruneTable& original) {
+	PruneTable::iterator iter;
+	for (iter = copy.begin(); iter != copy.end(); iter++) {
+		if (iter->second.permutation.data != original[iter->first].permutation.data)
+			releaseTable(iter->second.permutation);
+		if (iter->second.orientation.data != original[iter->first].orientation.data)
+			releaseTable(iter->second.orientation);
+	}
+	copy.clear();
+}
+
+// The replicas made by placePruneTables
+static tablereplicas& numaReplicas() {
+	static tablereplicas replicas = {NULL, std::vector<PruneTable>()};
+	return replicas;
+}
+
+static std::vector<int> numaNodeNumbers() {
+	std::vector<int> numbers;
+	std::map<int, std::vector<int> >::iterator iter;
+	for (iter = numaNodes().begin(); iter != numaNodes().end(); iter++)
+		numbers.push_back(iter->first);
+	return numbers;
+}
+
+// Interleave the tables over all nodes, and with NUMA_REPLICATE also give every node its
+// own copy of the complete tables up to NUMA_REPLICATE_LIMIT bytes and the partial tables
+static void placePruneTables(PruneTable& tables, int placement) {
+	tablereplicas& replicas = numaReplicas();
+	std::vector<int> numbers = numaNodeNumbers();
+	if (numbers.empty()) {
+		std::cout << "Only one NUMA node, pruning tables left in place.\n";
+		return;
+	}
+	PruneTable interleaved;
+	if (!setMemoryPolicy(MPOL_INTERLEAVE, numbers)) {
+		std::cout << "Could not set a NUMA memory policy, pruning tables left in place.\n";
+		return;
+	}
+	copyPruneTables(tables, interleaved, LLONG_MAX);
+	setMemoryPolicy(MPOL_DEFAULT, std::vector<int>());
+	releaseCopiedTables(tables, interleaved);
+	tables.swap(interleaved);
+	if (placement == NUMA_INTERLEAVE) {
+		std::cout << "Pruning tables interleaved over " << numbers.size() << " NUMA nodes.\n";
+		return;
+	}
+
+	replicas.primary = &tables;
+	replicas.nodes.resize(numbers.size());
+	for (unsigned int n = 0; n < numbers.size(); n++) {
+		setMemoryPolicy(MPOL_BIND, std::vector<int>(1, numbers[n]));
+		copyPruneTables(tables, replicas.nodes[n], NUMA_REPLICATE_LIMIT);
+	}
+	setMemoryPolicy(MPOL_DEFAULT, std::vector<int>());
+	std::cout << "Pruning tables replicated on " << numbers.size() << " NUMA nodes.\n";
+}
+
+static void releaseReplicas() {
+	tablereplicas& replicas = numaReplicas();
+	for (unsigned int n = 0; n < replicas.nodes.size(); n++)
+		releaseCopiedTables(replicas.nodes[n], *replicas.primary);
+	replicas.nodes.clear();
+	replicas.primary = NULL;
+}
+
+// The tables a search thread should use, given the tables or any of their replicas:
+// the replica of its node, if there is one
+static PruneTable& localPruneTables(PruneTable& tables) {
+	tablereplicas& replicas = numaReplicas();
+	bool replicated = replicas.primary == &tables;
+	for (unsigned int n = 0; n < replicas.nodes.size(); n++)
+		replicated = replicated || &replicas.nodes[n] == &tables;
+	if (!replicated)
+		return tables;
+#ifdef __linux__
+	int node = numaNodeIndex(sched_getcpu());
+	if (node >= 0 && node < (int) replicas.nodes.size())
+		return replicas.nodes[node];
+#endif
+	return tables;
+}
+
+// Pin OpenMP thread t to a CPU of node t mod the number of nodes, spreading the
+// threads evenly over the nodes
+static void pinThreads() {
+#if defined(__linux__) && defined(_OPENMP)
+	std::map<int, std::vector<int> > nodes = numaNodes();
+	std::vector<std::vector<int> > cpus;
+	std::map<int, std::vector<int> >::iterator iter;
+	for (iter = nodes.begin(); iter != nodes.end(); iter++)
+		cpus.push_back(iter->second);
+	if (cpus.empty()) {
+		// a single node: pin to the CPUs we may run on, in order
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		sched_getaffinity(0, sizeof(allowed), &allowed);
+		cpus.resize(1);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[0].push_back(cpu);
+	}
+	#pragma omp parallel
+	{
+		int t = omp_get_thread_num();
+		std::vector<int>& node = cpus[t % cpus.size()];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(node[(t / cpus.size()) % node.size()], &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	std::cout << "Search threads pinned to CPUs.\n";
+#endif
+}
+
+#endif
@@ -0,0 +1,448 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for complete pruning tables that stay on disk. With an out-of-core budget
+// (-O), complete tables may be larger than the usual limits. Such a table is built
+// straight into its file in the table cache, by a breadth-first search over a mapping of
+// the file, and then used from that mapping, with the kernel told that accesses are
+// random. A coarse companion table in memory is consulted first, so the disk is only
+// read when the coarse bound does not prune. It is a table of a projection of the
+// positions, holding for each the smallest depth of the positions that project to it.
+// Whenever more of the mapped tables than the budget is in memory, pages are given back.
+
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+// Largest complete table: normal, or more when tables can stay on disk
+static long long completeTableLimit(long long normal) {
+	return outOfCoreBudget > 0 ? OUT_OF_CORE_MAX_TABLE_SIZE : normal;
+}
+
+// Is a complete table of this many entries kept on disk?
+static bool outOfCoreSize(long long size) {
+	return outOfCoreBudget > 0 && size > std::min(MAX_COMPLETE_PERMUTATION_TABLE_SIZE, MAX_COMPLETE_ORIENTATION_TABLE_SIZE);
+}
+
+// Entries to pass over in order between checks of the resident size
+static long long trimInterval() {
+	return std::max(OUT_OF_CORE_BUILD_CHECK, outOfCoreBudget / 2);
+}
+
+// Entries to look up out of order between checks: as many as there are pages in half the budget
+static long long scatteredInterval() {
+	return std::max(OUT_OF_CORE_MIN_CHECK, trimInterval() / sysconf(_SC_PAGESIZE));
+}
+
+// Bytes of mapped files in memory, tables and the program itself
+static long long residentFileBytes() {
+	std::ifstream statm("/proc/self/statm");
+	long long size = 0, resident = 0, shared = 0;
+	statm >> size >> resident >> shared;
+	return shared * sysconf(_SC_PAGESIZE);
+}
+
+// Give pages of a mapping back if more of the mapped files than the budget is in
+// memory. Pages written through the mapping are only unmapped, and left to the kernel to
+// write out, as paging them out would wait for every one of them to be written.
+static void trimMapping(void *base, size_t length, bool written) {
+	if (residentFileBytes() <= outOfCoreBudget)
+		return;
+#ifdef MADV_PAGEOUT
+	if (written) {
+		madvise(base, length, MADV_DONTNEED);
+		return;
+	}
+	if (madvise(base, length, MADV_PAGEOUT) == 0)
+		return;
+#endif
+	madvise(base, length, MADV_DONTNEED);
+}
+
+// chunkSums of a mapped table, a slab at a time, within the budget
+static std::vector<unsigned long long> mappedSums(const char *data, long long length, void *base, size_t maplength) {
+	long long chunks = tableChunks(length);
+	long long slab = std::max(1LL, trimInterval() / TABLE_CHUNK);
+	std::vector<unsigned long long> sums(chunks);
+	for (long long first = 0; first < chunks; first += slab) {
+		long long last = std::min(chunks, first + slab);
+		#pragma omp parallel for
+		for (long long c = first; c < last; c++)
+			sums[c] = chunkSum(data, length, c);
+		trimMapping(base, maplength, false);
+	}
+	return sums;
+}
+
+// The pieces (labels or orientations) of an entry of a table on disk
+static void outOfCoreDecode(outofcore& disk, long long index, int *pieces) {
+	if (disk.kind == OUT_OF_CORE_ORIENTATION)
+		oIndex2Array(index, disk.size, disk.omod, pieces);
+	else if (disk.kind == OUT_OF_CORE_PERMUTATION)
+		pIndex2Array(index, disk.size, pieces);
+	else
+		pIndex3Array(index, disk.solved.data(), disk.size, pieces);
+}
+
+static long long outOfCoreEncode(outofcore& disk, int *pieces) {
+	if (disk.kind == OUT_OF_CORE_ORIENTATION)
+		return oVector2Index(pieces, disk.size, disk.omod);
+	else if (disk.kind == OUT_OF_CORE_PERMUTATION)
+		return pVector2Index(pieces, disk.size);
+	return pVector3Index(pieces, disk.size);
+}
+
+static void outOfCoreMove(outofcore& disk, int *from, int *to, substate& move) {
+	for (int i = 0; i < disk.size; i++) {
+		int p = move.permutation[i] - 1;
+		to[i] = disk.kind == OUT_OF_CORE_ORIENTATION ? (from[p] + move.orientation[p]) % disk.omod : from[p];
+	}
+}
+
+// Which coarse entry an entry belongs to. Orientation and combination indices count the
+// first position highest, so the entries with the same leading positions are a run of
+// them; for permutations, the coarse index is where the lowest numbered pieces are.
+static long long coarseIndex(outofcore& disk, long long key) {
+	if (disk.kind == OUT_OF_CORE_ORIENTATION)
+		return key / disk.block;
+	if (disk.kind == OUT_OF_CORE_COMBINATION)
+		return std::upper_bound(disk.starts.begin(), disk.starts.end(), key) - disk.starts.begin() - 1;
+	int perm[24], where[24];
+	pIndex2Array(key, disk.size, perm);
+	for (int i = 0; i < disk.size; i++)
+		if (perm[i] <= disk.pieces)
+			where[perm[i] - 1] = i;
+	long long index = 0;
+	unsigned int used = 0;
+	for (int v = 0; v < disk.pieces; v++) {
+		index = index * (disk.size - v) + where[v] - __builtin_popcount(used & ((1u << where[v]) - 1));
+		used |= 1u << where[v];
+	}
+	return index;
+}
+
+// The first entry of every run of combinations with the same labels in the first positions,
+// in the order of pVector3Index; stops once there are more than limit
+static void combinationStarts(std::map<int, int>& counts, int remaining, int positions, long long& start, std::vector<long long>& starts, long long limit) {
+	if ((long long) starts.size() > limit)
+		return;
+	std::map<int, int>::iterator iter;
+	if (positions == 0) {
+		starts.push_back(start);
+		long long run = factorial(remaining);
+		for (iter = counts.begin(); iter != counts.end(); iter++)
+			run /= factorial(iter->second);
+		start += run;
+		return;
+	}
+	for (iter = counts.begin(); iter != counts.end(); iter++)
+		if (iter->second > 0) {
+			iter->second--;
+			combinationStarts(counts, remaining - 1, positions - 1, start, starts, limit);
+			iter->second++;
+		}
+}
+
+// Tell apart as many leading pieces or positions as fit in the coarse table's share of
+// the table, and in the budget
+static void coarseLayout(outofcore& disk, long long entries) {
+	long long limit = std::max(1LL, std::min(entries / OUT_OF_CORE_COARSE_SHARE, outOfCoreBudget));
+	long long count = 1;
+	disk.pieces = 0;
+	if (disk.kind == OUT_OF_CORE_ORIENTATION) {
+		while (disk.pieces < disk.size && count * disk.omod <= limit) {
+			count *= disk.omod;
+			disk.pieces++;
+		}
+		disk.block = entries / count;
+	} else if (disk.kind == OUT_OF_CORE_PERMUTATION) {
+		while (disk.pieces < disk.size && count * (disk.size - disk.pieces) <= limit) {
+			count *= disk.size - disk.pieces;
+			disk.pieces++;
+		}
+	} else {
+		std::map<int, int> counts;
+		for (int i = 0; i < disk.size; i++)
+			counts[disk.solved[i]]++;
+		disk.starts.assign(1, 0);
+		for (int positions = 1; positions <= disk.size; positions++) {
+			std::vector<long long> starts;
+			long long start = 0;
+			combinationStarts(counts, disk.size, positions, start, starts, limit);
+			if ((long long) starts.size() > limit)
+				break;
+			disk.starts.swap(starts);
+			disk.pieces = positions;
+		}
+		count = disk.starts.size();
+	}
+	disk.coarse.assign(count, 127);
+}
+
+// Build the coarse companion of a mapped table in one sequential pass, then switch the
+// mapping to random access. Entries of positions the moves don't reach (-1) are left out.
+static void outOfCoreTable(completetable& table, int kind, int size, int omod, std::vector<int> solved) {
+	if (table.backing != TABLE_BACKING_MAPPED || table.disk != NULL)
+		return;
+	outofcore& disk = *(table.disk = new outofcore);
+	disk.kind = kind;
+	disk.size = size;
+	disk.omod = omod;
+	disk.solved = solved;
+	disk.lookups = 0;
+	disk.cuts = 0;
+	coarseLayout(disk, table.size);
+	char *coarse = disk.coarse.data();
+	long long count = disk.coarse.size();
+	long long interval = trimInterval();
+	madvise(table.base, table.length, MADV_SEQUENTIAL);
+	if (kind == OUT_OF_CORE_PERMUTATION) {
+		for (long long first = 0; first < table.size; first += interval) {
+			long long last = std::min(table.size, first + interval);
+			#pragma omp parallel for
+			for (long long i = first; i < last; i++) {
+				char depth = table.data[i];
+				if (depth < 0)
+					continue;
+				char *entry = coarse + coarseIndex(disk, i);
+				char old = __atomic_load_n(entry, __ATOMIC_RELAXED);
+				while (depth < old && !__atomic_compare_exchange_n(entry, &old, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					;
+			}
+			trimMapping(table.base, table.length, false);
+		}
+	} else {
+		// the entries of each coarse entry are a run, so every coarse entry is one minimum
+		long long slab = std::max(1LL, interval / std::max(1LL, table.size / count));
+		for (long long first = 0; first < count; first += slab) {
+			long long last = std::min(count, first + slab);
+			#pragma omp parallel for
+			for (long long b = first; b < last; b++) {
+				long long start = kind == OUT_OF_CORE_ORIENTATION ? b * disk.block : disk.starts[b];
+				long long end = b + 1 == count ? table.size : (kind == OUT_OF_CORE_ORIENTATION ? (b + 1) * disk.block : disk.starts[b + 1]);
+				for (long long i = start; i < end; i++)
+					if (table.data[i] >= 0 && table.data[i] < coarse[b])
+						coarse[b] = table.data[i];
+			}
+			trimMapping(table.base, table.length, false);
+		}
+	}
+	madvise(table.base, table.length, MADV_DONTNEED);
+	madvise(table.base, table.length, MADV_RANDOM);
+}
+
+// Give pages of the mapping back if more of it than the budget is in memory. Only one
+// thread checks a table at a time; the others carry on.
+static void trimResident(completetable& table) {
+	if (!table.disk->trimming.try_lock())
+		return;
+	trimMapping(table.base, table.length, false);
+	table.disk->trimming.unlock();
+}
+
+// completeCutoffs for a table on disk: the coarse entry first, the table itself only
+// if that does not cut off. Counts the lookups that went to the table.
+static unsigned long long outOfCoreCutoffs(completetable& table, long long *keys, int *depths, int count, unsigned long long active, long long& disklookups) {
+	unsigned long long cut = 0;
+	outofcore& disk = *table.disk;
+	long long lookups = 0, cuts = 0;
+	for (int c = 0; c < count; c++) {
+		if (((active >> c) & 1) == 0)
+			continue;
+		lookups++;
+		if (disk.coarse[coarseIndex(disk, keys[c])] > depths[c]) {
+			cut |= 1ULL << c;
+			cuts++;
+		} else {
+			disklookups++;
+			if (table.data[keys[c]] > depths[c])
+				cut |= 1ULL << c;
+		}
+	}
+	disk.lookups += lookups;
+	disk.cuts += cuts;
+	return cut;
+}
+
+// One breadth-first search over a table being built on disk, from the entries at depth 0,
+// a layer at a time
+static void outOfCoreLayers(outofcore& disk, char *table, long long entries, MoveList& moves, int set, std::vector<moveblocks>& blockrules, bool useBlocks, bool phaseOne, void *base, size_t length) {
+	std::vector<int> from(disk.size), to(disk.size);
+	long long page = sysconf(_SC_PAGESIZE);
+	long long scattered = scatteredInterval();
+	MoveList::iterator iter;
+	int len = 0;
+	long long c, touched = 0; // pages that may have come in since the last check
+	do {
+		c = 0;
+		for (long long p = 0; p < entries; p++) {
+			if (p % page == 0)
+				touched++;
+			if (touched >= scattered) {
+				trimMapping(base, length, true);
+				touched = 0;
+			}
+			if (table[p] != len)
+				continue;
+			outOfCoreDecode(disk, p, from.data());
+			int m = 0;
+			for (iter = moves.begin(); iter != moves.end(); iter++, m++) {
+				if (useBlocks && !setBlockLegal(disk.kind == OUT_OF_CORE_ORIENTATION ? NULL : from.data(), blockrules[m]))
+					continue;
+				outOfCoreMove(disk, from.data(), to.data(), iter->second.state[set]);
+				long long q = outOfCoreEncode(disk, to.data());
+				touched++;
+				if (table[q] == -1) {
+					table[q] = len + 1;
+					c++;
+				}
+			}
+		}
+		len++;
+		if (phaseOne)
+			std::cout << c << " positions in phase one, depth " << len << "\n";
+		else
+			std::cout << c << " positions at depth " << len << "\n";
+	} while (c > 0);
+}
+
+// Build a complete table too large for memory straight into its table file: the
+// breadth-first search of the in-memory builders, over a mapping of the file whose
+// written pages are flushed and given up whenever more of it than the budget is in memory
+static void buildOutOfCoreTable(string filename, unsigned long long fingerprint, int set, int kind, std::vector<int> solved, int omod, MoveList& moves, std::vector<int> ignore, std::vector<moveblocks>& blockrules, long long entries) {
+	std::cout << "Building pruning for " << setnameFromIndex(set) << (kind == OUT_OF_CORE_ORIENTATION ? " orientation" : " permutation") << " on disk.\n";
+	std::cout << "tablesize " << entries << "\n";
+	outofcore disk;
+	disk.kind = kind;
+	disk.size = solved.size();
+	disk.omod = omod;
+	disk.solved = solved;
+
+	tablefileheader header;
+	tablesection section;
+	memset(&header, 0, sizeof(header));
+	memset(&section, 0, sizeof(section));
+	section.kind = kind == OUT_OF_CORE_ORIENTATION ? SECTION_ORIENTATION_COMPLETE : SECTION_PERMUTATION_COMPLETE;
+	section.offset = alignTableOffset(sizeof(header) + sizeof(section));
+	section.entries = section.length = entries;
+	section.sums = alignTableOffset(section.offset + entries);
+	long long length = section.sums + tableChunks(entries)*sizeof(unsigned long long);
+	string tmpname = filename + ".tmp";
+	int fd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	void *base = MAP_FAILED;
+	if (fd >= 0 && ftruncate(fd, length) == 0)
+		base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		std::cerr << "Could not build pruning table in " << tmpname << "\n";
+		exit(-1);
+	}
+	char *table = (char*) base + section.offset;
+	long long interval = trimInterval();
+	for (long long first = 0; first < entries; first += interval) {
+		memset(table + first, -1, std::min(interval, entries - first));
+		trimMapping(base, length, true);
+	}
+
+	bool useBlocks = !blockrules.empty();
+	table[outOfCoreEncode(disk, solved.data())] = 0;
+	outOfCoreLayers(disk, table, entries, moves, set, blockrules, useBlocks && ignore.empty(), !ignore.empty(), base, length);
+	if (!ignore.empty()) {
+		// the first pass found every position; the solved ones are those that match
+		// the solved state on the pieces that are not ignored
+		std::vector<int> pieces(disk.size);
+		long long c = 0;
+		for (long long p = 0; p < entries; p++) {
+			if (p % interval == interval - 1)
+				trimMapping(base, length, true);
+			if (table[p] == -1)
+				continue;
+			outOfCoreDecode(disk, p, pieces.data());
+			bool solved_pos = true;
+			for (int j = 0; j < disk.size; j++)
+				if (ignore[j] == 0 && pieces[j] != solved[j])
+					solved_pos = false;
+			table[p] = solved_pos ? 0 : -1;
+			c += solved_pos;
+		}
+		std::cout << c << " solved positions.\n";
+		outOfCoreLayers(disk, table, entries, moves, set, blockrules, useBlocks, false, base, length);
+	}
+
+	std::vector<unsigned long long> sums = mappedSums(table, entries, base, length);
+	memcpy((char*) base + section.sums, sums.data(), sums.size()*sizeof(unsigned long long));
+	section.checksum = combineSums(sums, entries);
+	header.magic = TABLE_FILE_MAGIC;
+	header.version = TABLE_FILE_VERSION;
+	header.sections = 1;
+	header.fingerprint = fingerprint;
+	header.checksum = hashBytes((char*) &section, sizeof(section), fingerprint);
+	memcpy(base, &header, sizeof(header));
+	memcpy((char*) base + sizeof(header), &section, sizeof(section));
+	bool written = msync(base, length, MS_SYNC) == 0;
+	munmap(base, length);
+	close(fd);
+	if (!written || rename(tmpname.c_str(), filename.c_str()) != 0) {
+		std::cerr << "Could not write pruning tables to " << filename << "\n";
+		remove(tmpname.c_str());
+		exit(-1);
+	}
+}
+
+// If the table of a set is complete and kept on disk, build it straight into its cache
+// file; false if it is not such a table
+static bool buildOutOfCore(string filename, unsigned long long key, Position& solved, MoveList& moves, PieceTypes& datasets, Position& ignore, std::vector<Block>& blocks, int iter, int orient) {
+	int size = solved[iter].size;
+	if (orient) {
+		long long entries = 1;
+		for (int i = 0; i < size && entries <= OUT_OF_CORE_MAX_TABLE_SIZE; i++)
+			entries *= datasets[iter].omod;
+		if (!completeOrientationTable(datasets, iter) || !outOfCoreSize(entries))
+			return false;
+		std::vector<moveblocks> blockrules = setBlockRules(moves, iter, blocks, false);
+		std::vector<int> orientation(solved[iter].orientation, solved[iter].orientation + size);
+		buildOutOfCoreTable(filename, key, iter, OUT_OF_CORE_ORIENTATION, orientation, datasets[iter].omod, moves, ignoreFlags(ignore, iter, true), blockrules, entries);
+		return true;
+	}
+	if (!completePermutationTable(solved, ignore, iter))
+		return false;
+	std::vector<int> labels = tableSolved(solved, ignore, iter);
+	bool unique = uniquePermutation(labels.data(), size);
+	long long entries = unique ? factorial(size) : combinations(labels.data(), size);
+	if (!outOfCoreSize(entries))
+		return false;
+	std::vector<int> relabel = ignoreRelabel(solved, ignore, iter);
+	std::vector<int> tmp_ignore = relabel.empty() ? ignoreFlags(ignore, iter, false) : std::vector<int>();
+	std::vector<moveblocks> blockrules = setBlockRules(moves, iter, blocks, true, relabel);
+	buildOutOfCoreTable(filename, key, iter, unique ? OUT_OF_CORE_PERMUTATION : OUT_OF_CORE_COMBINATION, labels, 1, moves, tmp_ignore, blockrules, entries);
+	return true;
+}
+
+// How often the coarse table of each table on disk spared a read of the disk
+static void reportOutOfCore(PruneTable& tables) {
+	PruneTable::iterator iter;
+	for (iter = tables.begin(); iter != tables.end(); iter++)
+		for (int orient = 0; orient <= 1; orient++) {
+			completetable& table = orient ? iter->second.orientation : iter->second.permutation;
+			if (table.disk == NULL || table.disk->lookups == 0)
+				continue;
+			long long lookups = table.disk->lookups, cuts = table.disk->cuts;
+			std::cout << "Coarse table for " << setnameFromIndex(iter->first) << (orient ? " orientation" : " permutation") << " cut off " << cuts << " of " << lookups << " lookups (" << 100.0 * cuts / lookups << "%).\n";
+		}
+}
+
+#endif
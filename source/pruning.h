@@ -22,287 +22,500 @@
 #ifndef PRUNING_H
 #define PRUNING_H
 
-static PruneTable getCompletePruneTables(Position solved, MoveList moves, PieceTypes datasets, Position ignore, string filename, string suffix, bool usePruneTable)
+// Load each table from the table cache, or build it and add it to the cache. With
+// background, tables that are not cached are built by a background thread instead,
+// and handed over through takeBackgroundTables.
+static PruneTable getCompletePruneTables(Position solved, MoveList moves, PieceTypes datasets, Position ignore, std::vector<Block> blocks, string cachedir, bool usePruneTable, bool background)
 {
 	PruneTable table;
-	string filename2 = filename + suffix + ".tables";
-	std::ifstream fin;
-	fin.open(filename2.c_str(), std::ios::in | std::ios::binary);
-	
-	bool tablesExist = usePruneTable && fin.is_open(); // do tables exist?
-	bool oldTables = false; // are the tables older than the def file?
-	
-	if (tablesExist) {
-		fin.close(); // close ifstream so we can open a handle
-
-		// Changed HANDLE, FILETIME, GetFileTime, CreateFile, and CompareFileTime to Linux/C++ Equivalent -Matt S.
-		struct stat defWrite, tableWrite;
-		std::ofstream defHandle, tableHandle;
-		
-		defHandle.open(filename.c_str(), std::ios::in | std::ios::binary);
-		if (!defHandle.is_open()) {
-			std::cerr << "defHandle fail\n";
-			exit(-1);
-		}
-		if (stat(filename.c_str(), &defWrite) == -1) {
-			std::cerr << "stat of def fail\n";
-			exit(-1);
-		}
-		defHandle.close();
-		
-		tableHandle.open(filename2.c_str(), std::ios::in | std::ios::binary);
-		if (!tableHandle.is_open()) {
-			std::cerr << "tableHandle fail\n";
-			exit(-1);
-		}
-		if (stat(filename2.c_str(), &tableWrite) == -1) {
-			std::cerr << "stat of table fail\n";
-			exit(-1);
-		}
-		tableHandle.close();
-
-		if (difftime(defWrite.st_mtime, tableWrite.st_mtime) > 0) { // yes, def file is newer!
-			oldTables = true;
+	if (!usePruneTable) {
+		table = buildCompletePruneTables(solved, moves, datasets, ignore, blocks);
+		if (useBloom)
+			buildBloomFilters(table);
+		return table;
+	}
+#ifdef __EMSCRIPTEN__
+	background = false;
+#endif
+	mkdir(cachedir.c_str(), 0777);
+	std::vector<std::pair<int, int> > missing;
+	for (int iter=0; iter<solved.size(); iter++) {
+		table[iter]; // so updateDatasets sees every set, with or without tables
+		for (int orient = 0; orient <= 1; orient++) {
+			PruneTable single;
+			if (loadPruneTable(single, solved, moves, datasets, ignore, blocks, cachedir, iter, orient, !background))
+				mergeTables(table, single);
+			else
+				missing.push_back(std::make_pair(iter, orient));
 		}
-		
-		// reopen ifstream
-		fin.open(filename2.c_str(), std::ios::in | std::ios::binary);
 	}
-	
-	if (tablesExist && !oldTables){
-		std::cout << "Pruning tables found on file.\n";
-		
-		// Tables exist
-		int checksum;
-		fin.read((char*) (&checksum), sizeof(checksum)); // Not used yet
-
-		for (int iter=0; iter<solved.size(); iter++) {
-			int size = solved[iter].size;
-			if (datasets[iter].size != size) std::cout << "WTF\n";
-			if (factorial(size) <= MAX_COMPLETE_PERMUTATION_TABLE_SIZE && factorial(size) != -1 && uniquePermutation(solved[iter].permutation, size)){ 
-				// Complete tables, unique pieces
-				// Read permutation table
-				int tab_size = factorial(size);
-				table[iter].permutation.reserve(tab_size);
-
-				char *tmp_buff = new char[tab_size+1];
-				fin.get(tmp_buff, tab_size+1, 'A');
-				for (int i = 0; i < tab_size; i++){
-					table[iter].permutation.push_back(tmp_buff[i]);
-				}
-				delete[] tmp_buff;
-			
-			}
-			else if (combinations(solved[iter].permutation, size) <= MAX_COMPLETE_PERMUTATION_TABLE_SIZE && combinations(solved[iter].permutation, size) != -1 && !uniquePermutation(solved[iter].permutation, size)){ 
-				// Complete table, non-unique pieces
-				char buff;
-				int tab_size = combinations(solved[iter].permutation, size);
-				for (int i = 0; i < tab_size; i++){
-					fin.read((char*) (&buff), sizeof(buff));
-					table[iter].permutation.push_back(buff);
-				}
-			}
-			else{
-				// Partial table
-				int elements, keysize;
-				fin.read((char*) (&elements), sizeof(elements));
-				fin.read((char*) (&keysize), sizeof(keysize));
-
-				//std::cout << "elements " << elements << "\n";
-				//std::cout << "keysize " << keysize << "\n";
-				for (int i = 0; i < elements; i++){
-					char depth;
-					std::vector<long long> key;
-					long long tmp;
-					fin.read((char*) (&depth), sizeof(depth));
-					key.clear();
-					for (int j = 0; j < keysize; j++){
-						fin.read((char*) (&tmp), sizeof(tmp));
-						key.push_back(tmp);
-					}
-					table[iter].partialpermutation[key] = depth;
-				}
-				table[iter].partialpermutation_depth = maxDepth(table[iter].partialpermutation);
-			}
+	if (!missing.empty())
+		startBackgroundTables(solved, moves, datasets, ignore, blocks, cachedir, missing);
+	return table;
+}
 
-			double osize = log(datasets[iter].omod) * size;
-			if (osize < log(MAX_COMPLETE_ORIENTATION_TABLE_SIZE)){ // Not to big tables. Using log to avoid overflow.
-				long long num = 1;
-				for (int t = 0; t < size; t++)
-					num *= datasets[iter].omod;
-					
-					table[iter].orientation.reserve(num);
-					
-					char *tmp_buff = new char[num+1];
-					fin.get(tmp_buff, num+1, 'A');
-					for (int i = 0; i < num; i++){
-						table[iter].orientation.push_back(tmp_buff[i]);
-					}
-					delete[] tmp_buff;
-			}    
-			else{ // Partial orientation tables
-				int elements, keysize;
-				fin.read((char*) (&elements), sizeof(elements));
-				fin.read((char*) (&keysize), sizeof(keysize));
-				//std::cout << "elements " << elements << "\n";
-				//std::cout << "keysize " << keysize << "\n";
-				for (int i = 0; i < elements; i++){
-					char depth;
-					std::vector<long long> key;
-					long long tmp;
-					fin.read((char*) (&depth), sizeof(depth));
-					key.clear();
-					for (int j = 0; j < keysize; j++){
-						fin.read((char*) (&tmp), sizeof(tmp));
-						key.push_back(tmp);
-					}
-					table[iter].partialorientation[key] = depth;
-				}
-				table[iter].partialorientation_depth = maxDepth(table[iter].partialorientation);
+// Get one table: attach it from shared memory, read it from the cache, or, if build is
+// set, build it and add it to the cache. False if it is not cached and not built.
+static bool loadPruneTable(PruneTable& single, Position& solved, MoveList& moves, PieceTypes& datasets, Position& ignore, std::vector<Block>& blocks, string cachedir, int iter, int orient, bool build)
+{
+	string what = setnameFromIndex(iter) + (orient ? " orientation" : " permutation");
+	unsigned long long key = tableKey(solved, moves, datasets, ignore, blocks, iter, orient);
+	string filename = tableCacheFile(cachedir, key);
+	if (!orient)
+		single[iter].relabel = ignoreRelabel(solved, ignore, iter);
+	completetable& complete = orient ? single[iter].orientation : single[iter].permutation;
+	if (sharedTables && attachSharedTable(key, complete)) {
+		std::cout << "Pruning table for " << what << " attached from shared memory.\n";
+		if (hugeTables)
+			privateTable(complete);
+		reportBacking(complete, what);
+		return true;
+	}
+	int status = readTableFile(filename, key, single[iter]);
+	if (status == TABLE_FILE_OK) {
+		std::cout << "Pruning table for " << what << " found in cache.\n";
+	}
+	else {
+		if (status == TABLE_FILE_CORRUPT)
+			std::cout << "Cached pruning table for " << what << " is damaged or in an old format, recomputing.\n";
+		if (!build)
+			return false;
+		// a table kept on disk is built in its cache file, so it is only mapped from there
+		if (buildOutOfCore(filename, key, solved, moves, datasets, ignore, blocks, iter, orient)) {
+			if (readTableFile(filename, key, single[iter]) != TABLE_FILE_OK) {
+				std::cerr << "Could not read the pruning table for " << what << " back from " << filename << "\n";
+				exit(-1);
 			}
 		}
-		fin.close();
-		
-	}    
-	else{
-		if (tablesExist) { // tables exist, but they're old
-			std::cout << "Pruning tables older than def file, recomputing.\n";
-		} else { // no tables on file
-			std::cout << "Pruning tables not found on file, computing.\n";
+		else {
+			if (orient)
+				buildOrientationTable(single[iter], solved, moves, datasets, ignore, blocks, iter);
+			else
+				buildPermutationTable(single[iter], solved, moves, ignore, blocks, iter);
+			writeTableFile(filename, key, single[iter]);
 		}
-		table = buildCompletePruneTables(solved, moves, datasets, ignore);
-		std::ofstream fout;
-		fout.open(filename2.c_str(), std::ios::out | std::ios::binary);
-		int checksum = 1; // Not used yet
-		fout.write((char*) (&checksum), sizeof(checksum));
-		for (int iter=0; iter<solved.size(); iter++) {
-			int size = solved[iter].size;
-			if (datasets[iter].size != size) std::cout << "WTF\n";
-			if (factorial(size) <= MAX_COMPLETE_PERMUTATION_TABLE_SIZE && factorial(size) != -1 && uniquePermutation(solved[iter].permutation, size)){
-
-				// Write permutation table
-				int tab_size = factorial(size);
-				for (int i = 0; i < tab_size; i++){
-					fout.write((char*) (&table[iter].permutation[i]), sizeof(table[iter].permutation[i]));
-				}
-			}
-			else if (combinations(solved[iter].permutation, size) <= MAX_COMPLETE_PERMUTATION_TABLE_SIZE && combinations(solved[iter].permutation, size) != -1){
-				// Complete permutation table, not unique pieces
-				int tab_size = combinations(solved[iter].permutation, size);
-				for (int i = 0; i < tab_size; i++)
-					fout.write((char*) (&table[iter].permutation[i]), sizeof(table[iter].permutation[i]));
-			}
-			else{
-				// Partial permutation table  
-				// Table entries
-				int tmp_size = table[iter].partialpermutation.size();
-				fout.write((char*) (&tmp_size), sizeof(tmp_size));
-				
-				PARTIAL_TABLE_CONTAINER_TYPE::iterator tmp_iter;
-				tmp_iter = table[iter].partialpermutation.begin();
-				// Key size
-				tmp_size = tmp_iter->first.size();
-				fout.write((char*) (&tmp_size), sizeof(tmp_size));
-				
-				for (tmp_iter = table[iter].partialpermutation.begin(); tmp_iter != table[iter].partialpermutation.end(); tmp_iter++){
-					// Depth
-					fout.write((char*) (&tmp_iter->second), sizeof(tmp_iter->second));
-					for (unsigned int i = 0; i < tmp_iter->first.size(); i++)
-						fout.write((char*) (&(*tmp_iter).first[i]), sizeof(tmp_iter->first[i]));
-						// Keys
-				}
+	}
+	completetable& loaded = orient ? single[iter].orientation : single[iter].permutation;
+	if (outOfCoreSize(loaded.size)) {
+		// serve it from the cache file, not from the copy that was just built
+		if (loaded.backing != TABLE_BACKING_MAPPED) {
+			PruneTable mapped;
+			if (readTableFile(filename, key, mapped[iter]) == TABLE_FILE_OK) {
+				releasePruneTables(single);
+				single.swap(mapped);
+				if (!orient)
+					single[iter].relabel = ignoreRelabel(solved, ignore, iter);
 			}
+		}
+		completetable& ondisk = orient ? single[iter].orientation : single[iter].permutation;
+		std::vector<int> labels = orient ? std::vector<int>(solved[iter].orientation, solved[iter].orientation + solved[iter].size) : tableSolved(solved, ignore, iter);
+		int kind = orient ? OUT_OF_CORE_ORIENTATION : uniquePermutation(labels.data(), labels.size()) ? OUT_OF_CORE_PERMUTATION : OUT_OF_CORE_COMBINATION;
+		outOfCoreTable(ondisk, kind, labels.size(), datasets[iter].omod, labels);
+		if (ondisk.disk != NULL)
+			std::cout << "Pruning table for " << what << " is served from disk, with " << ondisk.disk->coarse.size() << " bytes in memory.\n";
+		return true;
+	}
+	if (sharedTables)
+		publishSharedTable(key, loaded);
+	if (hugeTables)
+		privateTable(loaded);
+	reportBacking(loaded, what);
+	if (useBloom)
+		buildBloomFilters(single);
+	return true;
+}
 
-			double osize = log(datasets[iter].omod) * size;
+// Tables for subsets of the moves, by the IDs of the moves in the subset
+static std::map<std::set<int>, PruneTable>& restrictedTables() {
+	static std::map<std::set<int>, PruneTable> tables;
+	return tables;
+}
 
-			if (osize < log(MAX_COMPLETE_ORIENTATION_TABLE_SIZE)){ // Not too big tables. Using log to avoid overflow.
-				for (unsigned int i = 0; i < table[iter].orientation.size(); i++){
-					fout.write((char*) (&table[iter].orientation[i]), sizeof(table[iter].orientation[i]));
-				}
-			}
-			else{ // Partial orientation table
-				// Table entries
-				int tmp_size = table[iter].partialorientation.size();
-				fout.write((char*) (&tmp_size), sizeof(tmp_size));
-
-				PARTIAL_TABLE_CONTAINER_TYPE::iterator tmp_iter;
-				tmp_iter = table[iter].partialorientation.begin();
-				// Key size
-				tmp_size = tmp_iter->first.size();
-				fout.write((char*) (&tmp_size), sizeof(tmp_size));
-				
-				for (tmp_iter = table[iter].partialorientation.begin() ; tmp_iter != table[iter].partialorientation.end(); tmp_iter++){
-					// Depth
-					fout.write((char*) (&tmp_iter->second), sizeof(tmp_iter->second));
-					for (unsigned int i = 0; i < tmp_iter->first.size(); i++)
-					// Keys
-						fout.write((char*) (&(*tmp_iter).first[i]), sizeof(tmp_iter->first[i]));
-				}
+// Tables for a subset of allMoves (what a scramble's MoveLimits leave, or the quarter turns
+// for QTM), from the table cache like the others, kept for later scrambles with the same
+// moves. A set with Ignore flags keeps its table for all moves,
+// because its solved positions are found by searching from the solved state, which may
+// not reach all of them with fewer moves.
+static PruneTable& restrictedPruneTables(Position& solved, MoveList& allMoves, MoveList& moves, PieceTypes& datasets, Position& ignore, std::vector<Block>& blocks, string cachedir, bool usePruneTable)
+{
+	std::set<int> ids;
+	MoveList::iterator moveIter;
+	for (moveIter = moves.begin(); moveIter != moves.end(); moveIter++)
+		ids.insert(moveIter->first);
+	std::map<std::set<int>, PruneTable>::iterator found = restrictedTables().find(ids);
+	if (found != restrictedTables().end())
+		return found->second;
+
+	PruneTable& table = restrictedTables()[ids];
+	for (int iter=0; iter<solved.size(); iter++) {
+		table[iter];
+		for (int orient = 0; orient <= 1; orient++) {
+			MoveList& tableMoves = ignoreFlags(ignore, iter, orient).empty() ? moves : allMoves;
+			PruneTable single;
+			if (usePruneTable)
+				loadPruneTable(single, solved, tableMoves, datasets, ignore, blocks, cachedir, iter, orient, true);
+			else {
+				if (orient)
+					buildOrientationTable(single[iter], solved, tableMoves, datasets, ignore, blocks, iter);
+				else
+					buildPermutationTable(single[iter], solved, tableMoves, ignore, blocks, iter);
+				if (useBloom)
+					buildBloomFilters(single);
 			}
+			mergeTables(table, single);
 		}
-		fout.close();
-
 	}
+	std::cout << "Pruning tables for a subset of " << moves.size() << " moves loaded.\n";
 	return table;
 }
-				
-static PruneTable buildCompletePruneTables(Position solved, MoveList moves, PieceTypes datasets, Position ignore)
+
+static void releaseRestrictedTables() {
+	std::map<std::set<int>, PruneTable>::iterator iter;
+	for (iter = restrictedTables().begin(); iter != restrictedTables().end(); iter++)
+		releasePruneTables(iter->second);
+	restrictedTables().clear();
+}
+
+#ifndef __EMSCRIPTEN__
+// The log the calling thread writes std::cout to, or NULL for the real std::cout
+static std::string*& threadLog() {
+	static thread_local std::string *log = NULL;
+	return log;
+}
+
+// Installed as the buffer of std::cout while tables are built in the background, so the
+// builder's messages are kept in its log and printed between depths, not in the middle
+// of the search output
+class threadlogbuf : public std::streambuf {
+public:
+	std::streambuf *out;
+protected:
+	int overflow(int c) {
+		if (c == EOF)
+			return 0;
+		if (threadLog() != NULL) {
+			threadLog()->push_back((char) c);
+			return c;
+		}
+		return out->sputc((char) c);
+	}
+	std::streamsize xsputn(const char *text, std::streamsize n) {
+		if (threadLog() != NULL) {
+			threadLog()->append(text, n);
+			return n;
+		}
+		return out->sputn(text, n);
+	}
+	int sync() {
+		return out->pubsync();
+	}
+};
+
+// The state of the background table builder
+static backgroundtables& backgroundTables() {
+	static backgroundtables builder;
+	return builder;
+}
+#endif
+
+// Build the missing tables (set, orientation) one by one in a background thread
+static void startBackgroundTables(Position solved, MoveList moves, PieceTypes datasets, Position ignore, std::vector<Block> blocks, string cachedir, std::vector<std::pair<int, int> > missing)
 {
-	PruneTable table;
-	std::vector<int> tmp_ignore;
-	for (int iter=0; iter<solved.size(); iter++) {
-		int size = solved[iter].size;
-		tmp_ignore.clear();
-		if (iter < ignore.size() && ignore[iter].size > 0)
-			for (int i = 0; i < size; i++)
-				tmp_ignore.push_back(ignore[iter].permutation[i]);
-			
-		if (factorial(size) <= MAX_COMPLETE_PERMUTATION_TABLE_SIZE && factorial(size) != -1 && uniquePermutation(solved[iter].permutation, size)){
-			// Complete table, unique pieces
-			std::vector<int> temp_perm;
-			for (int i = 0; i < size; i++)
-				temp_perm.push_back(solved[iter].permutation[i]);
-			table[iter].permutation = buildCompletePermutationPruningTable(temp_perm, moves, iter, tmp_ignore);
+#ifndef __EMSCRIPTEN__
+	backgroundtables& builder = backgroundTables();
+	builder.remaining = missing.size();
+	builder.stop = false;
+	static threadlogbuf logbuf;
+	if (std::cout.rdbuf() != &logbuf) {
+		logbuf.out = std::cout.rdbuf();
+		std::cout.rdbuf(&logbuf);
+	}
+	builder.thread = std::thread([=]() mutable {
+		backgroundtables& builder = backgroundTables();
+		for (unsigned int i = 0; i < missing.size() && !builder.stop; i++) {
+			PruneTable single;
+			string log;
+			threadLog() = &log;
+			loadPruneTable(single, solved, moves, datasets, ignore, blocks, cachedir, missing[i].first, missing[i].second, true);
+			threadLog() = NULL;
+			std::lock_guard<std::mutex> hold(builder.lock);
+			mergeTables(builder.finished, single);
+			builder.log += log;
+			builder.remaining--;
 		}
-		else if (combinations(solved[iter].permutation, size) <= MAX_COMPLETE_PERMUTATION_TABLE_SIZE && combinations(solved[iter].permutation, size) != -1 && !uniquePermutation(solved[iter].permutation, size)){
-			// Complete table, not unique pieces
-			std::vector<int> temp_perm;
-			for (int i= 0; i < size; i++)
-				temp_perm.push_back(solved[iter].permutation[i]);
-			table[iter].permutation = buildCompletePermutationPruningTable3(temp_perm, moves, iter, tmp_ignore);
+	});
+	std::cout << missing.size() << " pruning tables are being built in the background.\n";
+#endif
+}
+
+// Move the tables the background thread has finished into tables; false if there were none
+static bool takeBackgroundTables(PruneTable& tables) {
+#ifndef __EMSCRIPTEN__
+	backgroundtables& builder = backgroundTables();
+	if (!builder.thread.joinable())
+		return false;
+	std::lock_guard<std::mutex> hold(builder.lock);
+	if (builder.finished.empty())
+		return false;
+	std::cout << builder.log;
+	builder.log.clear();
+	mergeTables(tables, builder.finished);
+	builder.finished.clear();
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool backgroundTablesPending() {
+#ifndef __EMSCRIPTEN__
+	backgroundtables& builder = backgroundTables();
+	std::lock_guard<std::mutex> hold(builder.lock);
+	return builder.remaining > 0 || !builder.finished.empty();
+#else
+	return false;
+#endif
+}
+
+// Let the background thread finish the table it is building, then stop it
+static void stopBackgroundTables() {
+#ifndef __EMSCRIPTEN__
+	backgroundtables& builder = backgroundTables();
+	if (!builder.thread.joinable())
+		return;
+	builder.stop = true;
+	if (backgroundTablesPending())
+		std::cout << "Waiting for the pruning table being built in the background.\n";
+	builder.thread.join();
+	std::cout << builder.log;
+	builder.log.clear();
+	releasePruneTables(builder.finished);
+#endif
+}
+
+// Say where a large table ended up
+static void reportBacking(completetable& table, string what) {
+	if (table.size >= HUGE_PAGE_SIZE)
+		std::cout << "Pruning table for " << what << " is in " << backingName(table.backing) << ".\n";
+}
+
+// The ignore flags of one set, or nothing if no piece of it is ignored
+static std::vector<int> ignoreFlags(Position& ignore, int iter, bool orientation) {
+	std::vector<int> flags;
+	if (iter < ignore.size() && ignore[iter].size > 0) {
+		int *ign = orientation ? ignore[iter].orientation : ignore[iter].permutation;
+		bool any = false;
+		for (int i = 0; i < ignore[iter].size; i++)
+			any = any || ign[i] != 0;
+		if (any)
+			flags.assign(ign, ign + ignore[iter].size);
+	}
+	return flags;
+}
+
+// Labels for the permutation tables of a set with ignored pieces: the pieces whose solved
+// positions are ignored all get one new label, so the tables only tell apart the pieces
+// that have to be solved, and need no ignore flags. Empty if no piece of the set is
+// ignored, or an ignored piece shares its label with one that is not.
+static std::vector<int> ignoreRelabel(Position& solved, Position& ignore, int iter) {
+	std::vector<int> relabel;
+	std::vector<int> flags = ignoreFlags(ignore, iter, false);
+	if (flags.empty())
+		return relabel;
+	int size = solved[iter].size;
+	int *perm = solved[iter].permutation;
+	int maxLabel = 0;
+	for (int i = 0; i < size; i++) {
+		maxLabel = std::max(maxLabel, perm[i]);
+		for (int j = 0; j < size; j++)
+			if (flags[i] != 0 && flags[j] == 0 && perm[i] == perm[j])
+				return relabel;
+	}
+	relabel.resize(maxLabel + 1);
+	for (int label = 0; label <= maxLabel; label++)
+		relabel[label] = label;
+	for (int i = 0; i < size; i++)
+		if (flags[i] != 0)
+			relabel[perm[i]] = maxLabel + 1;
+	return relabel;
+}
+
+// The solved permutation of a set as its permutation tables see it
+static std::vector<int> tableSolved(Position& solved, Position& ignore, int iter) {
+	std::vector<int> perm(solved[iter].permutation, solved[iter].permutation + solved[iter].size);
+	std::vector<int> relabel = ignoreRelabel(solved, ignore, iter);
+	if (!relabel.empty())
+		for (unsigned int i = 0; i < perm.size(); i++)
+			perm[i] = relabel[perm[i]];
+	return perm;
+}
+
+// The permutation of sub as the permutation tables in table see it
+static int* tablePermutation(substate& sub, subprune& table) {
+	if (table.relabel.empty())
+		return sub.permutation;
+	static thread_local std::vector<int> relabelled;
+	relabelled.resize(sub.size);
+	for (int i = 0; i < sub.size; i++) {
+		int label = sub.permutation[i];
+		relabelled[i] = (label >= 0 && label < (int) table.relabel.size()) ? table.relabel[label] : label;
+	}
+	return relabelled.data();
+}
+
+static bool completePermutationTable(Position& solved, Position& ignore, int iter) {
+	int size = solved[iter].size;
+	std::vector<int> perm = tableSolved(solved, ignore, iter);
+	if (uniquePermutation(perm.data(), size))
+		return factorial(size) <= completeTableLimit(MAX_COMPLETE_PERMUTATION_TABLE_SIZE) && factorial(size) != -1;
+	long long comb = combinations(perm.data(), size);
+	return comb <= completeTableLimit(MAX_COMPLETE_PERMUTATION_TABLE_SIZE) && comb != -1;
+}
+
+static bool completeOrientationTable(PieceTypes& datasets, int iter) {
+	double osize = log(datasets[iter].omod) * datasets[iter].size;
+	return osize < log(completeTableLimit(MAX_COMPLETE_ORIENTATION_TABLE_SIZE)); // Using log to avoid overflow.
+}
+
+// Cache key of one table: a hash of exactly the inputs that determine it. For a permutation
+// table that is the solved permutation, the ignored permutations and the distinct permutations
+// the moves induce on the set, with the Blocks the set can check; orientation tables add
+// omod, orientations and twists.
+// Set names, move names, the order of moves and other sets do not matter, so the
+// same table is shared by every def containing the same set and moves.
+static unsigned long long tableKey(Position& solved, MoveList& moves, PieceTypes& datasets, Position& ignore, std::vector<Block>& blocks, int iter, bool orientation) {
+	int size = solved[iter].size;
+	unsigned long long h = hashMix(TABLE_FILE_VERSION, orientation);
+	h = hashMix(h, size);
+	h = hashMix(h, hashBytes((char*) solved[iter].permutation, size*sizeof(int), 1));
+	std::vector<int> ign = ignoreFlags(ignore, iter, orientation);
+	h = hashMix(h, hashBytes((char*) ign.data(), ign.size()*sizeof(int), 2));
+	if (orientation) {
+		h = hashMix(h, datasets[iter].omod);
+		h = hashMix(h, hashBytes((char*) solved[iter].orientation, size*sizeof(int), 3));
+		if (!completeOrientationTable(datasets, iter))
+			h = hashMix(h, partOsize);
+	} else {
+		if (!completePermutationTable(solved, ignore, iter))
+			h = hashMix(h, partPsize);
+		if (!ignoreRelabel(solved, ignore, iter).empty())
+			h = hashMix(h, TABLE_RELABELLED);
+	}
+
+	std::set<std::vector<int> > induced;
+	std::vector<moveblocks> blockrules = setBlockRules(moves, iter, blocks, !orientation, ignoreRelabel(solved, ignore, iter));
+	MoveList::iterator moveIter;
+	int m = 0;
+	for (moveIter = moves.begin(); moveIter != moves.end(); moveIter++, m++) {
+		substate& sub = moveIter->second.state[iter];
+		std::vector<int> effect(sub.permutation, sub.permutation + size);
+		bool identity = true;
+		for (int i = 0; i < size; i++)
+			identity = identity && sub.permutation[i] == i+1;
+		if (orientation) {
+			for (int i = 0; i < size; i++) {
+				effect.push_back(sub.orientation[i] % datasets[iter].omod);
+				identity = identity && effect.back() == 0;
+			}
 		}
-		else{
-			// Partial permutation table 
-			std::vector<int> temp_perm;
-			for (int i = 0; i < size; i++)
-				temp_perm.push_back(solved[iter].permutation[i]);
-			table[iter].partialpermutation = buildPartialPermutationPruningTable(temp_perm, moves, iter, tmp_ignore);
-			table[iter].partialpermutation_depth = maxDepth(table[iter].partialpermutation);
+		if (!blockrules.empty()) {
+			effect.push_back(blockrules[m].legal);
+			for (unsigned int r = 0; r < blockrules[m].rules.size(); r++) {
+				blockrule& rule = blockrules[m].rules[r];
+				effect.push_back(rule.required);
+				effect.push_back(rule.pieces.size());
+				effect.insert(effect.end(), rule.pieces.begin(), rule.pieces.end());
+			}
 		}
+		if (!identity)
+			induced.insert(effect);
+	}
+	std::set<std::vector<int> >::iterator effectIter;
+	for (effectIter = induced.begin(); effectIter != induced.end(); effectIter++)
+		h = hashMix(h, hashBytes((char*) effectIter->data(), effectIter->size()*sizeof(int), 4));
+	return hashFinish(h);
+}
 
-		tmp_ignore.clear();
-		if (iter < ignore.size() && ignore[iter].size > 0)
-			for (int i = 0; i < size; i++)
-				tmp_ignore.push_back(ignore[iter].orientation[i]);
-		double osize = log(datasets[iter].omod) * size;
-		if (osize < log(MAX_COMPLETE_ORIENTATION_TABLE_SIZE)){ // Not to big tables. Using log to avoid overflow.
-			std::vector<int> temp_orient;
-			for (int i = 0; i < size; i++)
-				temp_orient.push_back(solved[iter].orientation[i]);
-			table[iter].orientation = buildCompleteOrientationPruningTable(temp_orient , moves, iter, datasets[iter].omod, tmp_ignore);
+static string tableCacheFile(string cachedir, unsigned long long key) {
+	char name[32];
+	sprintf(name, "%016llx.tables", key);
+	return cachedir + "/" + name;
+}
+
+// Move the tables in from into into
+static void mergeTables(PruneTable& into, PruneTable& from) {
+	PruneTable::iterator iter;
+	for (iter = from.begin(); iter != from.end(); iter++) {
+		subprune& sub = into[iter->first];
+		if (iter->second.permutation.size > 0 || iter->second.partialpermutation.size() > 0)
+			sub.relabel = iter->second.relabel;
+		if (iter->second.permutation.size > 0)
+			sub.permutation = iter->second.permutation;
+		if (iter->second.orientation.size > 0)
+			sub.orientation = iter->second.orientation;
+		if (iter->second.partialpermutation.size() > 0) {
+			sub.partialpermutation.swap(iter->second.partialpermutation);
+			sub.partialpermutation_depth = iter->second.partialpermutation_depth;
+			std::swap(sub.partialpermutation_bloom, iter->second.partialpermutation_bloom);
 		}
-		else{
-			std::vector<int> temp_orient;
-			for (int i = 0; i < size; i++)
-				temp_orient.push_back(solved[iter].orientation[i]);
-			table[iter].partialorientation = buildPartialOrientationPruningTable(temp_orient, moves, iter, datasets[iter].omod, tmp_ignore);
-			table[iter].partialorientation_depth = maxDepth(table[iter].partialorientation);
+		if (iter->second.partialorientation.size() > 0) {
+			sub.partialorientation.swap(iter->second.partialorientation);
+			sub.partialorientation_depth = iter->second.partialorientation_depth;
+			std::swap(sub.partialorientation_bloom, iter->second.partialorientation_bloom);
 		}
 	}
+}
+
+static PruneTable buildCompletePruneTables(Position solved, MoveList moves, PieceTypes datasets, Position ignore, std::vector<Block> blocks)
+{
+	PruneTable table;
+	for (int iter=0; iter<solved.size(); iter++) {
+		buildPermutationTable(table[iter], solved, moves, ignore, blocks, iter);
+		buildOrientationTable(table[iter], solved, moves, datasets, ignore, blocks, iter);
+	}
 	return table;
-}                    
+}
+
+static void buildPermutationTable(subprune& table, Position& solved, MoveList& moves, Position& ignore, std::vector<Block>& blocks, int iter)
+{
+	int size = solved[iter].size;
+	std::vector<int> tmp_ignore = ignoreFlags(ignore, iter, false);
+	table.relabel = ignoreRelabel(solved, ignore, iter);
+	if (!table.relabel.empty())
+		tmp_ignore.clear(); // the ignored pieces are collapsed instead
+	std::vector<moveblocks> blockrules = setBlockRules(moves, iter, blocks, true, table.relabel);
+	std::vector<int> temp_perm = tableSolved(solved, ignore, iter);
+	if (completePermutationTable(solved, ignore, iter) && uniquePermutation(temp_perm.data(), size)){
+		// Complete table, unique pieces
+		table.permutation = heapTable(buildCompletePermutationPruningTable(temp_perm, moves, iter, tmp_ignore, blockrules));
+	}
+	else if (completePermutationTable(solved, ignore, iter)){
+		// Complete table, not unique pieces
+		table.permutation = heapTable(buildCompletePermutationPruningTable3(temp_perm, moves, iter, tmp_ignore, blockrules));
+	}
+	else{
+		// Partial permutation table 
+		table.partialpermutation = buildPartialPermutationPruningTable(temp_perm, moves, iter, tmp_ignore, blockrules);
+		table.partialpermutation_depth = maxDepth(table.partialpermutation);
+	}
+}
 
-static std::vector<char> buildCompleteOrientationPruningTable(std::vector<int> solved, MoveList moves, int setname, int omod, std::vector<int> ignore)
+static void buildOrientationTable(subprune& table, Position& solved, MoveList& moves, PieceTypes& datasets, Position& ignore, std::vector<Block>& blocks, int iter)
+{
+	int size = solved[iter].size;
+	std::vector<int> tmp_ignore = ignoreFlags(ignore, iter, true);
+	std::vector<moveblocks> blockrules = setBlockRules(moves, iter, blocks, false);
+	std::vector<int> temp_orient(solved[iter].orientation, solved[iter].orientation + size);
+	if (completeOrientationTable(datasets, iter)){ // Not to big tables.
+		table.orientation = heapTable(buildCompleteOrientationPruningTable(temp_orient , moves, iter, datasets[iter].omod, tmp_ignore, blockrules));
+	}
+	else{
+		table.partialorientation = buildPartialOrientationPruningTable(temp_orient, moves, iter, datasets[iter].omod, tmp_ignore, blockrules);
+		table.partialorientation_depth = maxDepth(table.partialorientation);
+	}
+}
+
+static std::vector<char> buildCompleteOrientationPruningTable(std::vector<int> solved, MoveList moves, int setname, int omod, std::vector<int> ignore, std::vector<moveblocks>& blockrules)
 {
 	std::cout << "Building pruning for " << setnameFromIndex(setname) << " orientation.\n";
 	std::vector<char> table;
@@ -328,7 +541,10 @@ static std::vector<char> buildCompleteOrientationPruningTable(std::vector<int> s
 		c = 0;
 		for (int p = 0; p < tablesize; p++){
 			if (table[p] == len){
-				for (iter = moves.begin(); iter != moves.end(); iter++){
+				int m = 0;
+				for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+					if (ignore.empty() && !blockrules.empty() && !setBlockLegal(NULL, blockrules[m]))
+						continue;
 					int q = oVector2Index(applySubmoveO(oIndex2Vector(p, vector_size, omod), iter->second.state[setname].orientation, iter->second.state[setname].permutation, iter->second.state[setname].size, omod), omod);
 					if (table[q] == -1){
 						table[q] = len + 1;
@@ -369,7 +585,10 @@ static std::vector<char> buildCompleteOrientationPruningTable(std::vector<int> s
 			c = 0;
 			for (int p = 0; p < tablesize; p++){
 				if (table[p] == len){
-					for (iter = moves.begin(); iter != moves.end(); iter++){
+					int m = 0;
+					for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+						if (!blockrules.empty() && !setBlockLegal(NULL, blockrules[m]))
+							continue;
 						int q = oVector2Index(applySubmoveO(oIndex2Vector(p, vector_size, omod), iter->second.state[setname].orientation, iter->second.state[setname].permutation, iter->second.state[setname].size, omod), omod);
 						if (table[q] == -1){
 							table[q] = len + 1;
@@ -387,7 +606,7 @@ static std::vector<char> buildCompleteOrientationPruningTable(std::vector<int> s
 }
 
 // Complete table, unique pieces
-static std::vector<char> buildCompletePermutationPruningTable(std::vector<int> solved, MoveList moves, int setname, std::vector<int> ignore)
+static std::vector<char> buildCompletePermutationPruningTable(std::vector<int> solved, MoveList moves, int setname, std::vector<int> ignore, std::vector<moveblocks>& blockrules)
 {
 	std::cout << "Building pruning for " << setnameFromIndex(setname) << " permutation.\n";
 	std::vector<char> table;
@@ -411,13 +630,18 @@ static std::vector<char> buildCompletePermutationPruningTable(std::vector<int> s
 		c = 0;
 		for (int p = 0; p < tablesize; p++){
 			if (table[p] == len){
-				for (iter = moves.begin(); iter != moves.end(); iter++){
+				int* from = (ignore.empty() && !blockrules.empty()) ? pIndex2Array(p, vector_size) : NULL;
+				int m = 0;
+				for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+					if (from != NULL && !setBlockLegal(from, blockrules[m]))
+						continue;
 					int q = pVector2Index(applySubmoveP(pIndex2Array(p, vector_size), iter->second.state[setname].permutation, vector_size), vector_size);
 					if (table[q] == -1){
 						table[q] = len + 1;
 						c++;
 					}
 				}
+				delete[] from;
 			}      
 		}
 		len++;
@@ -453,13 +677,18 @@ static std::vector<char> buildCompletePermutationPruningTable(std::vector<int> s
 			c = 0;
 			for (int p = 0; p < tablesize; p++){
 				if (table[p] == len){
-					for (iter = moves.begin(); iter != moves.end(); iter++){
+					int* from = blockrules.empty() ? NULL : pIndex2Array(p, vector_size);
+					int m = 0;
+					for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+						if (from != NULL && !setBlockLegal(from, blockrules[m]))
+							continue;
 						int q = pVector2Index(applySubmoveP(pIndex2Array(p, vector_size), iter->second.state[setname].permutation, vector_size), vector_size);
 						if (table[q] == -1){
 							table[q] = len + 1;
 							c++;
 						}
 					}
+					delete[] from;
 				}      
 			}
 			len++;
@@ -471,7 +700,7 @@ static std::vector<char> buildCompletePermutationPruningTable(std::vector<int> s
 }
 
 // Complete table, not unique pieces
-static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int> solved, MoveList moves, int setname, std::vector<int> ignore)
+static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int> solved, MoveList moves, int setname, std::vector<int> ignore, std::vector<moveblocks>& blockrules)
 {
 	std::cout << "Building pruning for " << setnameFromIndex(setname) << " permutation\n";
 	std::vector<char> table;
@@ -494,7 +723,11 @@ static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int>
 		c = 0;
 		for (int p = 0; p < tablesize; p++){
 			if (table[p] == len){
-				for (iter = moves.begin(); iter != moves.end(); iter++){
+				int* from = (ignore.empty() && !blockrules.empty()) ? pIndex3Array(p, solved) : NULL;
+				int m = 0;
+				for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+					if (from != NULL && !setBlockLegal(from, blockrules[m]))
+						continue;
 					// FIX, assumes that inverses to all moves are also one move
 					int q = pVector3Index(applySubmoveP(pIndex3Array(p, solved), iter->second.state[setname].permutation, vector_size), vector_size);
 					// FIX
@@ -503,6 +736,7 @@ static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int>
 						c++;
 					}
 				}
+				delete[] from;
 			}      
 		}
 		len++;
@@ -537,7 +771,11 @@ static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int>
 			c = 0;
 			for (int p = 0; p < tablesize; p++){
 				if (table[p] == len){
-					for (iter = moves.begin(); iter != moves.end(); iter++){
+					int* from = blockrules.empty() ? NULL : pIndex3Array(p, solved);
+					int m = 0;
+					for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+						if (from != NULL && !setBlockLegal(from, blockrules[m]))
+							continue;
 						// FIX, assumes that inverses to all moves are also one move
 						int q = pVector3Index(applySubmoveP(pIndex3Array(p, solved), iter->second.state[setname].permutation, vector_size), vector_size);
 						// FIX
@@ -546,6 +784,7 @@ static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int>
 							c++;
 						}
 					}
+					delete[] from;
 				}      
 			}
 			len++;
@@ -556,7 +795,7 @@ static std::vector<char> buildCompletePermutationPruningTable3(std::vector<int>
 	return table;
 }
 
-static PARTIAL_TABLE_CONTAINER_TYPE buildPartialOrientationPruningTable(std::vector<int> solved, MoveList moves, int setname, int omod, std::vector<int> ignore)
+static PARTIAL_TABLE_CONTAINER_TYPE buildPartialOrientationPruningTable(std::vector<int> solved, MoveList moves, int setname, int omod, std::vector<int> ignore, std::vector<moveblocks>& blockrules)
 {
 	std::cout << "Building partial pruning table for " << setnameFromIndex(setname) << " orientation.\n";
 	PARTIAL_TABLE_CONTAINER_TYPE table;
@@ -577,7 +816,10 @@ static PARTIAL_TABLE_CONTAINER_TYPE buildPartialOrientationPruningTable(std::vec
 		for (iter2 = table.begin(); iter2 != table.end(); iter2++){
 			if (iter2->second == len && !abort){
 				std::vector<int> pos = unpackVector(iter2->first, solved.size());
-				for (iter = moves.begin(); iter != moves.end(); iter++){
+				int m = 0;
+				for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+					if (!blockrules.empty() && !setBlockLegal(NULL, blockrules[m]))
+						continue;
 					std::vector<int> q = applySubmoveO(pos, iter->second.state[setname].orientation, iter->second.state[setname].permutation, iter->second.state[setname].size, omod);
 					std::vector<long long> newpos = packVector(q);
 					if (table.find(newpos) == table.end()){
@@ -607,7 +849,7 @@ static PARTIAL_TABLE_CONTAINER_TYPE buildPartialOrientationPruningTable(std::vec
 }
 
 
-static PARTIAL_TABLE_CONTAINER_TYPE buildPartialPermutationPruningTable(std::vector<int> solved, MoveList moves, int setname, std::vector<int> ignore)
+static PARTIAL_TABLE_CONTAINER_TYPE buildPartialPermutationPruningTable(std::vector<int> solved, MoveList moves, int setname, std::vector<int> ignore, std::vector<moveblocks>& blockrules)
 {
 	std::cout << "Building partial pruning for " << setnameFromIndex(setname) << " permutation.\n";
 	PARTIAL_TABLE_CONTAINER_TYPE table;
@@ -656,7 +898,10 @@ static PARTIAL_TABLE_CONTAINER_TYPE buildPartialPermutationPruningTable(std::vec
 		for (iter2 = table.begin(); iter2 != table.end(); iter2++){
 			if (iter2->second == len && !abort){
 				std::vector<int> pos = unpackVector(iter2->first, solved.size());
-				for (iter = moves.begin(); iter != moves.end(); iter++){
+				int m = 0;
+				for (iter = moves.begin(); iter != moves.end(); iter++, m++){
+					if (!blockrules.empty() && !setBlockLegal(pos.data(), blockrules[m]))
+						continue;
 					std::vector<int> q = applySubmoveP(pos , iter->second.state[setname].permutation, iter->second.state[setname].size);
 					std::vector<long long> newpos = packVector(q);
 					if (table.find(newpos) == table.end()){
@@ -699,7 +944,7 @@ static void updateDatasets(PieceTypes& datasets, PruneTable& tables)
 {
 	PruneTable::iterator iter;
 	for (iter = tables.begin(); iter != tables.end(); iter++){
-		if (iter->second.permutation.size() >= 1)
+		if (iter->second.permutation.size >= 1)
 			datasets[iter->first].ptabletype = TABLE_TYPE_COMPLETE;
 		else if (iter->second.partialpermutation.size() >= 1)
 			datasets[iter->first].ptabletype = TABLE_TYPE_PARTIAL;
@@ -710,68 +955,286 @@ static void updateDatasets(PieceTypes& datasets, PruneTable& tables)
 		for (int i = 0; i < datasets[iter->first].size; i++)
 			tablesize *= datasets[iter->first].omod;  // tablesize := omod ^ solved.size() 
 									// checking for numbers getting to large might be smart
-		if (iter->second.orientation.size() < 1)
+		if (iter->second.orientation.size < 1)
 			datasets[iter->first].otabletype = TABLE_TYPE_NONE;
-		else if (tablesize <= MAX_COMPLETE_ORIENTATION_TABLE_SIZE)
+		else if (tablesize <= completeTableLimit(MAX_COMPLETE_ORIENTATION_TABLE_SIZE))
 			datasets[iter->first].otabletype = TABLE_TYPE_COMPLETE;
 		else
 			datasets[iter->first].otabletype = TABLE_TYPE_PARTIAL;
 	}
 }
 
-static bool prune(Position& state, int depth, PieceTypes& datasets, PruneTable& prunetables){
-	for (int iter2=0; iter2<state.size(); iter2++) {
-
-		// Orientation pruning
-		if (datasets[iter2].otabletype == TABLE_TYPE_COMPLETE){
-			int index = oVector2Index(state[iter2].orientation, state[iter2].size, datasets[iter2].omod);
-			if (prunetables[iter2].orientation[index]  > depth){
-				return true;
-			}
+// The lookups to do for every set with a table: orientation first, then permutation
+static probeset pruneProbes(PieceTypes& datasets, PruneTable& prunetables) {
+	probeset probes;
+	probes.tables = &prunetables;
+	PieceTypes::iterator iter;
+	for (iter = datasets.begin(); iter != datasets.end(); iter++) {
+		pruneprobe probe;
+		probe.set = iter->first;
+		probe.omod = iter->second.omod;
+		probe.table = &prunetables[iter->first];
+		probe.disklookups = 0;
+		if (iter->second.otabletype == TABLE_TYPE_COMPLETE) {
+			probe.kind = PROBE_ORIENTATION_COMPLETE;
+			probes.probes.push_back(probe);
+		} else if (iter->second.otabletype == TABLE_TYPE_PARTIAL) {
+			probe.kind = PROBE_ORIENTATION_PARTIAL;
+			probes.probes.push_back(probe);
 		}
-		else if (datasets[iter2].otabletype == TABLE_TYPE_PARTIAL){
-			std::vector<long long> index = packVector(state[iter2].orientation, state[iter2].size);
-			
-			if (prunetables[iter2].partialorientation_depth >= depth){
-				if (prunetables[iter2].partialorientation.find(index) != prunetables[iter2].partialorientation.end()){ // If the position exist in the table then...
-					if (prunetables[iter2].partialorientation[index] > depth){
-						return true;
-					}                         
+		if (iter->second.ptabletype == TABLE_TYPE_COMPLETE) {
+			probe.kind = iter->second.uniqueperm && probe.table->relabel.empty() ? PROBE_PERMUTATION_COMPLETE : PROBE_PERMUTATION_COMBINATION;
+			probes.probes.push_back(probe);
+		} else if (iter->second.ptabletype == TABLE_TYPE_PARTIAL) {
+			probe.kind = PROBE_PERMUTATION_PARTIAL;
+			probes.probes.push_back(probe);
+		}
+	}
+	std::vector<int> order;
+	probestats none = {0, 0, 0, 0};
+	for (unsigned int i = 0; i < probes.probes.size(); i++)
+		order.push_back(i);
+	probes.order.assign(PROBE_DEPTHS, order);
+	probes.stats.assign(PROBE_DEPTHS, std::vector<probestats>(probes.probes.size(), none));
+	probes.evaluations.assign(PROBE_DEPTHS, 0);
+	return probes;
+}
+
+// Order the lookups at one depth by expected cost per cutoff, cheapest first: the
+// measured time of a lookup divided by the fraction of lookups that cut off. The
+// statistics are then halved, so the order keeps following the search.
+static void reorderProbes(probeset& probes, int d) {
+	std::vector<probestats>& stats = probes.stats[d];
+	std::vector<std::pair<double, int> > costs;
+	for (unsigned int i = 0; i < stats.size(); i++) {
+		double time = stats[i].timed > 0 ? stats[i].seconds / stats[i].timed : 1e-9;
+		double rate = (stats[i].cutoffs + 1.0) / (stats[i].probes + 2.0);
+		costs.push_back(std::make_pair(time / rate, i));
+		stats[i].probes /= 2;
+		stats[i].cutoffs /= 2;
+		stats[i].timed /= 2;
+		stats[i].seconds /= 2;
+	}
+	std::stable_sort(costs.begin(), costs.end());
+	for (unsigned int i = 0; i < costs.size(); i++)
+		probes.order[d][i] = costs[i].second;
+	probes.evaluations[d] = 0;
+}
+
+// Prefetch an entry of a complete table; not of one on disk, whose coarse index is
+// worked out when it is looked up
+static void prefetchEntry(completetable& table, long long key) {
+	if (table.disk == NULL)
+		__builtin_prefetch(table.data + key);
+}
+
+// Where each probe will look for this position: the index into a complete table, or the
+// Bloom hash for a partial one. Keys are stored by probe, stride apart, so the keys of all
+// children of a node form one array per probe. The entries are prefetched, so that
+// computing the keys of all children first overlaps their cache misses.
+static void probeKeys(Position& state, int depth, probeset& probes, long long *keys, int stride) {
+	for (unsigned int i = 0; i < probes.probes.size(); i++) {
+		pruneprobe& probe = probes.probes[i];
+		substate& sub = state[probe.set];
+		long long& key = keys[i * stride];
+		switch (probe.kind) {
+			case PROBE_ORIENTATION_COMPLETE:
+				key = oVector2Index(sub.orientation, sub.size, probe.omod);
+				prefetchEntry(probe.table->orientation, key);
+				break;
+			case PROBE_PERMUTATION_COMPLETE:
+				key = pVector2Index(sub.permutation, sub.size);
+				prefetchEntry(probe.table->permutation, key);
+				break;
+			case PROBE_PERMUTATION_COMBINATION:
+				key = pVector3Index(tablePermutation(sub, *probe.table), sub.size);
+				prefetchEntry(probe.table->permutation, key);
+				break;
+			case PROBE_ORIENTATION_PARTIAL:
+				if (probe.table->partialorientation_depth >= depth && probe.table->partialorientation_bloom.blocks != 0) {
+					key = bloomHash(sub.orientation, sub.size);
+					__builtin_prefetch(bloomBlock(probe.table->partialorientation_bloom, key));
 				}
-				else{
-					return true;
+				break;
+			case PROBE_PERMUTATION_PARTIAL:
+				if (probe.table->partialpermutation_depth >= depth && probe.table->partialpermutation_bloom.blocks != 0) {
+					key = bloomHash(tablePermutation(sub, *probe.table), sub.size);
+					__builtin_prefetch(bloomBlock(probe.table->partialpermutation_bloom, key));
 				}
-			}
+				break;
 		}
-		// Permutation pruning
-		if (datasets[iter2].ptabletype == TABLE_TYPE_COMPLETE && datasets[iter2].uniqueperm){
-			int index = pVector2Index(state[iter2].permutation, state[iter2].size);
-			if (prunetables[iter2].permutation[index]  > depth){
-				return true;
-			}
-		}
-		else if (datasets[iter2].ptabletype == TABLE_TYPE_COMPLETE && !datasets[iter2].uniqueperm){
-			long long index = pVector3Index(state[iter2].permutation, state[iter2].size);
-			if (prunetables[iter2].permutation[index]  > depth){
-				return true;
-			}
-		}
-		else if (datasets[iter2].ptabletype == TABLE_TYPE_PARTIAL){;
-			std::vector<long long> index = packVector(state[iter2].permutation, state[iter2].size);
+	}
+}
+
+// Look up a partial table: true if the position is deeper than depth
+static bool prunePartial(int vec[], int size, int depth, PARTIAL_TABLE_CONTAINER_TYPE& table, int tabledepth, bloomfilter& filter, unsigned long long h) {
+	if (tabledepth < depth)
+		return false;
+	if (filter.blocks != 0 && !bloomMayContain(filter, h))
+		return true; // not in the table, so deeper than it goes
+	std::vector<long long> index = packVector(vec, size);
+	PARTIAL_TABLE_CONTAINER_TYPE::iterator found = table.find(index);
+	if (found == table.end())
+		return true;
+	return found->second > depth;
+}
 
-			if (prunetables[iter2].partialpermutation_depth >= depth){
-				if (prunetables[iter2].partialpermutation.find(index) != prunetables[iter2].partialpermutation.end()){
-					if (prunetables[iter2].partialpermutation[index] > depth){
-						return true;
+// Which of the active children (bits of active) have an entry in a complete table above
+// their depth
+static unsigned long long completeCutoffs(completetable& table, long long *keys, int *depths, int count, unsigned long long active) {
+	unsigned long long cut = 0;
+	int c = 0;
+#ifdef __AVX2__
+	// eight children at a time: gather four bytes at each index and keep the low one,
+	// except near the end of the table, where the lanes are left to the scalar code
+	__m256i last = _mm256_set1_epi32((int) std::min(table.size - 3, (long long) INT_MAX));
+	for (; c + 8 <= count; c += 8) {
+		unsigned int lanes = (active >> c) & 0xff;
+		if (lanes == 0)
+			continue;
+		int index[8];
+		for (int j = 0; j < 8; j++)
+			index[j] = ((lanes >> j) & 1) ? (int) keys[c + j] : 0;
+		__m256i vindex = _mm256_loadu_si256((__m256i*) index);
+		__m256i inside = _mm256_cmpgt_epi32(last, vindex);
+		__m256i entries = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*) table.data, vindex, inside, 1);
+		entries = _mm256_srai_epi32(_mm256_slli_epi32(entries, 24), 24);
+		__m256i deeper = _mm256_and_si256(inside, _mm256_cmpgt_epi32(entries, _mm256_loadu_si256((__m256i*) (depths + c))));
+		unsigned int found = _mm256_movemask_ps(_mm256_castsi256_ps(deeper));
+		unsigned int outside = ~_mm256_movemask_ps(_mm256_castsi256_ps(inside)) & lanes;
+		for (int j = 0; j < 8; j++)
+			if (((outside >> j) & 1) && table.data[keys[c + j]] > depths[c + j])
+				found |= 1 << j;
+		cut |= (unsigned long long) (found & lanes) << c;
+	}
+#endif
+	for (; c < count; c++)
+		if (((active >> c) & 1) && table.data[keys[c]] > depths[c])
+			cut |= 1ULL << c;
+	return cut;
+}
+
+// Which of the active children a partial table's Bloom filter rules out
+static unsigned long long bloomCutoffs(bloomfilter& filter, int tabledepth, long long *keys, int *depths, int count, unsigned long long active) {
+	unsigned long long cut = 0;
+	if (filter.blocks == 0)
+		return 0;
+	for (int c = 0; c < count; c++)
+		if (((active >> c) & 1) && tabledepth >= depths[c] && !bloomMayContain(filter, keys[c]))
+			cut |= 1ULL << c;
+	return cut;
+}
+
+static double probeClock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Check up to 64 children at once against the complete tables and the Bloom filters,
+// using keys from probeKeys: child c needs depths[c] moves. Returns the active
+// children that survive; pruneChild still has to look them up in the partial tables.
+// Lookups go in the order learned for the depth, and are counted for it.
+static unsigned long long pruneBatch(int count, int *depths, probeset& probes, long long *keys, int stride, unsigned long long active) {
+	if (active == 0)
+		return 0;
+	int d = std::min(depths[__builtin_ctzll(active)], PROBE_DEPTHS - 1);
+	std::vector<int>& order = probes.order[d];
+	std::vector<probestats>& stats = probes.stats[d];
+	int evaluated = __builtin_popcountll(active);
+	bool timing = (probes.evaluations[d] + evaluated) / PROBE_TIMING_SAMPLE != probes.evaluations[d] / PROBE_TIMING_SAMPLE;
+	probes.evaluations[d] += evaluated;
+	for (unsigned int k = 0; k < order.size() && active != 0; k++) {
+		int i = order[k];
+		pruneprobe& probe = probes.probes[i];
+		double start = timing ? probeClock() : 0;
+		unsigned long long cut = 0;
+		switch (probe.kind) {
+			case PROBE_ORIENTATION_COMPLETE:
+			case PROBE_PERMUTATION_COMPLETE:
+			case PROBE_PERMUTATION_COMBINATION: {
+				completetable& table = probe.kind == PROBE_ORIENTATION_COMPLETE ? probe.table->orientation : probe.table->permutation;
+				if (table.disk == NULL) {
+					cut = completeCutoffs(table, keys + i*stride, depths, count, active);
+				} else {
+					cut = outOfCoreCutoffs(table, keys + i*stride, depths, count, active, probe.disklookups);
+					if (probe.disklookups >= std::min(OUT_OF_CORE_CHECK, scatteredInterval())) {
+						trimResident(table);
+						probe.disklookups = 0;
 					}
 				}
-				else{
-					return true;
-				}
+				break;
 			}
+			case PROBE_ORIENTATION_PARTIAL:
+				cut = bloomCutoffs(probe.table->partialorientation_bloom, probe.table->partialorientation_depth, keys + i*stride, depths, count, active);
+				break;
+			case PROBE_PERMUTATION_PARTIAL:
+				cut = bloomCutoffs(probe.table->partialpermutation_bloom, probe.table->partialpermutation_depth, keys + i*stride, depths, count, active);
+				break;
+		}
+		int probed = __builtin_popcountll(active);
+		if (timing) {
+			stats[i].seconds += probeClock() - start;
+			stats[i].timed += probed;
+		}
+		stats[i].probes += probed;
+		stats[i].cutoffs += __builtin_popcountll(cut);
+		active &= ~cut;
+	}
+	if (probes.evaluations[d] >= PROBE_REORDER_INTERVAL)
+		reorderProbes(probes, d);
+	return active;
+}
+
+// The rest of the check of a child that passed pruneBatch: its entries in the partial tables
+static bool pruneChild(Position& state, int depth, probeset& probes, long long *keys, int stride) {
+	int d = std::min(depth, PROBE_DEPTHS - 1);
+	for (unsigned int i = 0; i < probes.probes.size(); i++) {
+		pruneprobe& probe = probes.probes[i];
+		substate& sub = state[probe.set];
+		bool cutoff = false;
+		if (probe.kind == PROBE_ORIENTATION_PARTIAL)
+			cutoff = prunePartial(sub.orientation, sub.size, depth, probe.table->partialorientation,
+				probe.table->partialorientation_depth, probe.table->partialorientation_bloom, keys[i * stride]);
+		else if (probe.kind == PROBE_PERMUTATION_PARTIAL)
+			cutoff = prunePartial(tablePermutation(sub, *probe.table), sub.size, depth, probe.table->partialpermutation,
+				probe.table->partialpermutation_depth, probe.table->partialpermutation_bloom, keys[i * stride]);
+		if (cutoff) {
+			probes.stats[d][i].cutoffs++;
+			return true;
 		}
 	}
 	return false;
 }
 
+// true if the tables show the position needs more than depth moves
+static bool prune(Position& state, int depth, probeset& probes){
+	std::vector<long long> keys(probes.probes.size(), 0);
+	probeKeys(state, depth, probes, keys.data(), 1);
+	return pruneBatch(1, &depth, probes, keys.data(), 1, 1) == 0 || pruneChild(state, depth, probes, keys.data(), 1);
+}
+
+// The least depth the tables allow for the position, or limit if they rule out all below it
+static int pruneDistance(Position& state, probeset& probes, int limit) {
+	int depth = 0;
+	while (depth < limit && prune(state, depth, probes))
+		depth++;
+	return depth;
+}
+
+// How many moves more than depth the complete tables in memory say a child cut off by
+// pruneBatch needs, from its keys; 1 if it was cut off by another table
+static int cutExcess(probeset& probes, long long *keys, int stride, int depth) {
+	int excess = 1;
+	for (unsigned int i = 0; i < probes.probes.size(); i++) {
+		pruneprobe& probe = probes.probes[i];
+		if (probe.kind != PROBE_ORIENTATION_COMPLETE && probe.kind != PROBE_PERMUTATION_COMPLETE && probe.kind != PROBE_PERMUTATION_COMBINATION)
+			continue;
+		completetable& table = probe.kind == PROBE_ORIENTATION_COMPLETE ? probe.table->orientation : probe.table->permutation;
+		if (table.disk == NULL)
+			excess = std::max(excess, table.data[keys[i * stride]] - depth);
+	}
+	return excess;
+}
+
 #endif
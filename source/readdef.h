@@ -205,6 +205,23 @@ public:
 					}
 					blocks.push_back(tmp_block);
 				}
+				else if (command == "Subgroup"){
+					string movename;
+					fin >> movename;
+					while(movename != "End") {
+						if (!moveIn(movename, moves)){
+							std::cerr << "Move " << movename << " used in Subgroup is not previously declared.\n";
+							exit(-1);
+						}
+						// a move given by its own name brings its powers along
+						int id = getMoveID(movename, moves);
+						MoveList::iterator iter;
+						for (iter = moves.begin(); iter != moves.end(); iter++)
+							if (iter->first == id || (moves[id].parentID == id && iter->second.parentID == id))
+								subgroup[iter->first] = iter->second;
+						fin >> movename;
+					}
+				}
 				else if (command == "MoveLimits"){
 					std::cout << "MoveLimits command has been moved to scramble file!\n";
 					string newmove;
@@ -313,6 +330,10 @@ public:
 	std::vector<Block> getBlocks(){
 		return blocks;
 	}
+
+	MoveList getSubgroup(){
+		return subgroup;
+	}
 	
 	std::map<string, int> getMoveLimits() {
 		return moveLimits;
@@ -328,6 +349,7 @@ private:
 	std::vector<int> parentMoves; // IDs of parent moves
 	std::set<MovePair> forbidden;
 	std::vector<Block> blocks;
+	MoveList subgroup; // moves of the Subgroup, for the two-phase solver
 	std::map<string, int> moveLimits; // limits on # of moves
 	
 	// Add all powers of this move
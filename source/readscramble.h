@@ -30,6 +30,10 @@ public:
 		int current_max = maxDepthMain;
 		int current_slack = 0;
 		int current_metric = 0;
+		double current_twophase = -1;
+		double current_timelimit = timeLimitMain;
+		long long current_nodelimit = nodeLimitMain;
+		bool current_fallback = false;
 		Position state(solved.size());
 		Position ignore ;
 		string name;
@@ -160,6 +164,10 @@ public:
 				scramble.max_depth = current_max;
 				scramble.slack = current_slack;
 				scramble.metric = current_metric;
+				scramble.twoPhase = current_twophase;
+				scramble.timeLimit = current_timelimit;
+				scramble.nodeLimit = current_nodelimit;
+				scramble.fallback = current_fallback;
 				scramble.printState = 0;
 				scramble.moveLimits = std::vector<MoveLimit>();
 				for (unsigned int i=0; i<moveLimits.size(); i++) {
@@ -244,6 +252,10 @@ public:
 				scramble.max_depth = current_max;
 				scramble.slack = current_slack;
 				scramble.metric = current_metric;
+				scramble.twoPhase = current_twophase;
+				scramble.timeLimit = current_timelimit;
+				scramble.nodeLimit = current_nodelimit;
+				scramble.fallback = current_fallback;
 				scramble.printState = 1;
 				scramble.moveLimits = std::vector<MoveLimit>();
 				for (unsigned int i=0; i<moveLimits.size(); i++) {
@@ -331,6 +343,10 @@ public:
 				scramble.max_depth = current_max;
 				scramble.slack = current_slack;
 				scramble.metric = current_metric;
+				scramble.twoPhase = current_twophase;
+				scramble.timeLimit = current_timelimit;
+				scramble.nodeLimit = current_nodelimit;
+				scramble.fallback = current_fallback;
 				scramble.printState = 1;
 				scramble.moveLimits = std::vector<MoveLimit>();
 				for (unsigned int i=0; i<moveLimits.size(); i++) {
@@ -362,6 +378,45 @@ public:
 			else if (command == "HTM") {
 				current_metric = 0;
 			}
+			// TwoPhase - solve with the def's Subgroup, looking for shorter solutions for some seconds
+			else if (command == "TwoPhase") {
+				current_twophase = 0;
+				fin >> std::ws;
+				if (isdigit(fin.peek()) || fin.peek() == '.') {
+					fin >> current_twophase;
+					if (fin.fail()){
+						std::cerr << "Error reading TwoPhase\n";
+						exit(-1);
+					}
+				}
+			}
+			// Optimal - back to the optimal search
+			else if (command == "Optimal") {
+				current_twophase = -1;
+			}
+			// TimeLimit - seconds the optimal search may take, 0 for no limit
+			else if (command == "TimeLimit") {
+				fin >> current_timelimit;
+				if (fin.fail()){
+					std::cerr << "Error reading TimeLimit\n";
+					exit(-1);
+				}
+			}
+			// NodeLimit - nodes the optimal search may search, 0 for no limit
+			else if (command == "NodeLimit") {
+				fin >> current_nodelimit;
+				if (fin.fail()){
+					std::cerr << "Error reading NodeLimit\n";
+					exit(-1);
+				}
+			}
+			// Fallback - solve with two phases when the limits run out before a solution
+			else if (command == "Fallback") {
+				current_fallback = true;
+			}
+			else if (command == "NoFallback") {
+				current_fallback = false;
+			}
 			// Move Limits
 			else if (command == "MoveLimits"){
 				moveLimits.clear();
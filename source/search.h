@@ -22,121 +22,68 @@
 #ifndef SEARCH_H
 #define SEARCH_H
 
-static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTypes& datasets, PruneTable& prunetables, std::set<MovePair>& forbiddenPairs, Position& ignore, std::vector<Block>& blocks, int depth, int metric, std::vector<MoveLimit>& moveLimits, string sequence, int old_move, bool splitThreads){
-	// if we ran out of depth or results to find, it's either solved or not
-	if (depth <= 0 || solutionCountMain>=maxResultsMain) {
+// Search for solutions of exactly depth moves. Children are checked against the pruning
+// tables by their parent, before recursing, so only the root (splitThreads) prunes itself.
+// hash is the Zobrist hash of state, if the transposition table is used. How far the
+// cut off nodes were from fitting in depth goes to recordExcess.
+static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTypes& datasets, probeset& probes, std::set<MovePair>& forbiddenPairs, Position& ignore, std::vector<Block>& blocks, int depth, int metric, std::vector<MoveLimit>& moveLimits, string sequence, int old_move, unsigned long long hash, bool splitThreads){
+	countNode();
+
+	// if we have all the results, or ran out of time or nodes, stop without checking
+	if (searchStopped())
+		return false;
+
+	// if we ran out of depth, it's either solved or not
+	if (depth <= 0) {
 		if (isSolved(state, solved, ignore, datasets)){
-            if (++solutionCountMain<=maxResultsMain) {
-                #pragma omp critical
-                {
-                    std::cout << sequence << "\n";
-                }
-            }
+			reportSolution(sequence);
 			return true;
 		} else {
+			recordExcess(1);
 			return false;
 		}
 	}
 
 	// use pruning tables to see if we don't have enough depth left
-	if (skipPrune || prune(state, depth, datasets, prunetables))
+	if (splitThreads && (skipPrune || prune(state, depth, probes))) {
+		recordExcess(1);
 		return false;
+	}
 
 	// define variables; initialize room for a new state
 	bool success = false;
 	bool using_blocks = (blocks.size() != 0);
 	bool using_limits = (moveLimits.size() != 0);
+	bool using_transpositions = transpositions().active;
 
-    if(splitThreads) {
-        #pragma omp parallel //num_threads(1)
+    if (splitThreads) {
+        // search from the root on one thread, which hands big subtrees to the others
+        // as tasks; idle threads take them from its queue and spawn their own in turn
+        #pragma omp parallel
+        #pragma omp single
         {
-        //for (iter = moves.begin(); iter != moves.end(); iter++){
-            Position new_state(state.size());
-            for (int iter2 = 0; iter2 < state.size(); iter2++) {
-                new_state[iter2] = newSubstate(state[iter2].size);
-            }
-
-            std::vector<MoveLimit> localMoveLimits = moveLimits;
-
-            #pragma omp for
-            for (int i = 0; i < moves.size(); i++){
-                MoveList::iterator iter = moves.begin();
-                for(int j = 0; j < i; j++)
-                    iter++;
-                // if we have a forbidden pair, try the next move
-                if (forbiddenPairs.find(MovePair(old_move, iter->first)) != forbiddenPairs.end())
-                    continue;
-                // if this move breaks the blocks, try the next move
-                if (using_blocks)
-                    if (!blockLegal(state, blocks, iter->second.state))
-                        continue;
-                // if movelimits make this move impossible, try the next move
-                if (using_limits) {
-                    bool forbidden = false;
-                    for (unsigned int i=0; i<localMoveLimits.size(); i++) {
-                        if (localMoveLimits[i].limit <= 0 && limitMatches(localMoveLimits[i], iter->second)) {
-                            forbidden = true;
-                            break;
-                        }
-                    }
-                    if (forbidden) continue;
-                }
-
-                // compute depth of new position using HTM or QTM
-                int newDepth;
-                if (metric == 0) { // HTM
-                    newDepth = depth - 1;
-                } else { // QTM
-                    newDepth = depth - iter->second.qtm;
-                }
-                if (newDepth < 0) continue; // not enough depth for this move? try the next one
-
-                // compute new position
-                applyMove(state, new_state, iter->second.state, datasets);
-
-                // decrement applicable move limits, and check if we got into an unsolvable state
-                if (using_limits) {
-                    bool isSolvable = true; // see if we have stumbled into a situation that requires more of the limited moves
-                    for (unsigned int i=0; i<localMoveLimits.size(); i++) {
-                        if (limitMatches(localMoveLimits[i], iter->second)) {
-                            localMoveLimits[i].limit--;
-                            if (localMoveLimits[i].limit == 0) {
-                                isSolvable = isSolvable && stillSolvable(new_state, solved, ignore, localMoveLimits[i].owned);
-                            }
-                        }
-                    }
-                    if (!isSolvable) {
-                        for (unsigned int i=0; i<moveLimits.size(); i++)
-                            if (limitMatches(localMoveLimits[i], iter->second))
-                                localMoveLimits[i].limit++;
-                        continue;
-                    }
-                }
-
-                // recurse!
-                if (treeSolve(new_state, solved, moves, datasets, prunetables, forbiddenPairs, ignore, blocks, newDepth, metric, localMoveLimits, sequence + " " + iter->second.name, iter->first, false))
-                    success = true;
-
-                // clean up modified move limits
-                if (using_limits)
-                    for (unsigned int i=0; i<localMoveLimits.size(); i++)
-                        if (limitMatches(localMoveLimits[i], iter->second))
-                            localMoveLimits[i].limit++;
-            }
-            // free new_state memory
-            for (int iter2=0; iter2<state.size(); iter2++) {
-                delete new_state[iter2].permutation;
-                delete new_state[iter2].orientation;
-            }
+            probeset rootProbes = threadProbes(datasets, *probes.tables, probes.order);
+            success = treeSolve(state, solved, moves, datasets, rootProbes, forbiddenPairs, ignore, blocks, depth, metric, moveLimits, sequence, old_move, hash, false);
+            probes.order = rootProbes.order;
         }
-	}
+        return success;
+    }
     else {
         Position new_state(state.size());
         for (int iter2 = 0; iter2<state.size(); iter2++) {
             new_state[iter2] = newSubstate(state[iter2].size);
         }
-        MoveList::iterator iter = moves.begin();
-        for (iter = moves.begin(); iter != moves.end(); iter++){
+
+        // first pass: find the legal children and their table keys, prefetching the
+        // entries, so the cache misses of all children overlap. Keys are stored by
+        // probe, one array of children each, for pruneBatch.
+        int stride = moves.size();
+        std::vector<MoveList::iterator> children;
+        std::vector<int> childDepths;
+        std::vector<long long> keys(probes.probes.size() * stride, 0);
+        int excess = INT_MAX; // the least of the cut off children, recorded once
+        MoveList::iterator iter;
+        for (iter = moves.begin(); iter != moves.end() && !searchStopped(); iter++){
             // if we have a forbidden pair, try the next move
             if (forbiddenPairs.find(MovePair(old_move, iter->first)) != forbiddenPairs.end())
                 continue;
@@ -162,10 +109,58 @@ static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTy
             } else { // QTM
                 newDepth = depth - iter->second.qtm;
             }
-            if (newDepth < 0) continue; // not enough depth for this move? try the next one
+            if (newDepth < 0) { // not enough depth for this move? try the next one
+                excess = std::min(excess, -newDepth);
+                continue;
+            }
+
+            if (newDepth > 0 && !skipPrune) {
+                applyMove(state, new_state, iter->second.state, datasets);
+                probeKeys(new_state, newDepth, probes, &keys[children.size()], stride);
+            }
+            children.push_back(iter);
+            childDepths.push_back(newDepth);
+        }
+
+        unsigned long long survivors = 0;
+        unsigned long long active = 0;
+        bool spawned = false;
+        bool taskSuccess = false;
+        // second pass: check the children against the tables, up to 64 at a time,
+        // and recurse into the ones that survive
+        for (unsigned int c = 0; c < children.size() && !searchStopped(); c++){
+            if (c % 64 == 0) {
+                int count = std::min((int) children.size() - (int) c, 64);
+                active = 0;
+                for (int b = 0; b < count; b++)
+                    if (childDepths[c + b] > 0 && !skipPrune)
+                        active |= 1ULL << b;
+                survivors = ~active | pruneBatch(count, &childDepths[c], probes, &keys[c], stride, active);
+            }
+            iter = children[c];
+            int newDepth = childDepths[c];
+            if (((survivors >> (c % 64)) & 1) == 0) {
+                if (excess > 1 && ((active >> (c % 64)) & 1))
+                    excess = std::min(excess, cutExcess(probes, &keys[c], stride, newDepth));
+                continue;
+            }
 
             // compute new position
             applyMove(state, new_state, iter->second.state, datasets);
+            if (newDepth > 0 && !skipPrune && pruneChild(new_state, newDepth, probes, &keys[c], stride)) {
+                excess = 1;
+                continue;
+            }
+
+            // skip positions already searched to this depth through other sequences
+            unsigned long long childHash = 0;
+            if (using_transpositions && newDepth >= TRANSPOSITION_MIN_DEPTH) {
+                childHash = movedHash(hash, state, new_state, iter->first);
+                if (transpositionFailed(childHash, iter->first, newDepth)) {
+                    excess = 1; // what it was cut off by is not kept
+                    continue;
+                }
+            }
 
             // decrement applicable move limits, and check if we got into an unsolvable state
             if (using_limits) {
@@ -179,6 +174,7 @@ static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTy
                     }
                 }
                 if (!isSolvable) {
+                    excess = 1;
                     for (unsigned int i=0; i<moveLimits.size(); i++)
                         if (limitMatches(moveLimits[i], iter->second))
                             moveLimits[i].limit++;
@@ -186,9 +182,33 @@ static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTy
                 }
             }
 
-            // recurse!
-            if (treeSolve(new_state, solved, moves, datasets, prunetables, forbiddenPairs, ignore, blocks, newDepth, metric, moveLimits, sequence + " " + iter->second.name, iter->first, false))
+            // recurse! Big subtrees become tasks, while the other threads need work
+            if (spawnSearchTask(newDepth)) {
+                Position child = copyPosition(new_state);
+                std::vector<MoveLimit> childLimits = moveLimits;
+                string childSequence = sequence + " " + iter->second.name;
+                int childMove = iter->first;
+                std::vector<std::vector<int> > childOrder = probes.order; // probes itself stays with this thread
+                spawned = true;
+                #pragma omp task default(shared) firstprivate(child, childLimits, childSequence, childMove, childOrder, childHash, newDepth)
+                {
+                    if (!searchStopped()) {
+                        probeset taskProbes = threadProbes(datasets, *probes.tables, childOrder);
+                        if (treeSolve(child, solved, moves, datasets, taskProbes, forbiddenPairs, ignore, blocks, newDepth, metric, childLimits, childSequence, childMove, childHash, false)) {
+                            #pragma omp atomic write
+                            taskSuccess = true;
+                        }
+                        else if (using_transpositions && !searchStopped())
+                            transpositionStore(childHash, childMove, newDepth);
+                    }
+                    freePosition(child);
+                    pendingSearchTasks()--;
+                }
+            }
+            else if (treeSolve(new_state, solved, moves, datasets, probes, forbiddenPairs, ignore, blocks, newDepth, metric, moveLimits, sequence + " " + iter->second.name, iter->first, childHash, false))
                 success = true;
+            else if (using_transpositions && !searchStopped())
+                transpositionStore(childHash, iter->first, newDepth);
 
             // clean up modified move limits
             if (using_limits)
@@ -196,6 +216,12 @@ static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTy
                     if (limitMatches(moveLimits[i], iter->second))
                         moveLimits[i].limit++;
         }
+        if (spawned) {
+            #pragma omp taskwait
+            success = success || taskSuccess;
+        }
+        if (excess != INT_MAX)
+            recordExcess(excess);
         // free new_state memory
         for (int iter2 = 0; iter2<state.size(); iter2++) {
             delete new_state[iter2].permutation;
@@ -205,6 +231,172 @@ static bool treeSolve(Position state, Position& solved, MoveList& moves, PieceTy
 	return success;
 }
 
+// Count a solution and print it, if it is one of the first maxResultsMain;
+// at that many, all search threads are stopped
+static void reportSolution(string& sequence) {
+	int found = ++solutionCountMain;
+	if (found<=maxResultsMain) {
+		#pragma omp critical
+		{
+			std::cout << (inverseSearch().active ? invertSequence(sequence) : sequence) << "\n";
+		}
+	}
+	if (found>=maxResultsMain)
+		stopSearch = true;
+}
+
+// The least number of moves by which a node cut off by the search, or a leaf that was not
+// solved, lacked depth. The next depth with any chance of a solution is that much deeper.
+static std::atomic<int>& searchExcess() {
+	static std::atomic<int> excess(INT_MAX);
+	return excess;
+}
+
+static void recordExcess(int excess) {
+	std::atomic<int>& least = searchExcess();
+	int old = least.load(std::memory_order_relaxed);
+	while (excess < old && !least.compare_exchange_weak(old, excess, std::memory_order_relaxed))
+		;
+}
+
+// The parity that the length of every solution of the scramble has, or -1 if it can vary.
+// Every set whose pieces are all told apart has a permutation parity that each move flips
+// or keeps; if the flips of some of these sets add up to the length of each move (mod 2),
+// their parities in the scramble give the parity of the length.
+static int solutionParity(ScrambleDef& scramble, Position& solved, MoveList& moves, PieceTypes& datasets) {
+	std::vector<int> sets;
+	for (unsigned int s = 0; s < scramble.state.size() && (int) sets.size() < PARITY_MAX_SETS; s++) {
+		if (!datasets[s].uniqueperm || !uniquePermutation(scramble.state[s].permutation, scramble.state[s].size))
+			continue;
+		bool checked = true;
+		if (scramble.ignore.size() != 0) {
+			checked = scramble.ignore[s].size > 0;
+			for (int i = 0; i < scramble.ignore[s].size && checked; i++)
+				checked = scramble.ignore[s].permutation[i] == 0;
+		}
+		if (checked)
+			sets.push_back(s);
+	}
+
+	// bit k of a flip mask is sets[k]
+	std::vector<std::pair<unsigned int, int> > flips; // per move, and its length mod 2
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++) {
+		unsigned int mask = 0;
+		for (unsigned int k = 0; k < sets.size(); k++)
+			if (oddPermutation(iter->second.state[sets[k]].permutation, iter->second.state[sets[k]].size))
+				mask |= 1 << k;
+		int length = scramble.metric == 0 ? 1 : iter->second.qtm;
+		flips.push_back(std::make_pair(mask, length % 2));
+	}
+	for (unsigned int subset = 1; subset < (1u << sets.size()); subset++) {
+		bool matches = true;
+		for (unsigned int m = 0; m < flips.size() && matches; m++)
+			matches = __builtin_parity(flips[m].first & subset) == flips[m].second;
+		if (!matches)
+			continue;
+		int parity = 0;
+		for (unsigned int k = 0; k < sets.size(); k++)
+			if ((subset >> k) & 1) {
+				int s = sets[k];
+				parity ^= oddPermutation(scramble.state[s].permutation, scramble.state[s].size);
+				parity ^= oddPermutation(solved[s].permutation, solved[s].size);
+			}
+		return parity;
+	}
+	return -1;
+}
+
+// Whether to search a child with remaining depth depth as a task of its own. The size
+// of a subtree grows exponentially with its depth, so only deep ones are worth a task,
+// and only while fewer than SEARCH_TASKS_PER_THREAD per thread are waiting; otherwise
+// the child is searched right away, on this thread.
+static bool spawnSearchTask(int depth) {
+#ifdef _OPENMP
+	if (depth < SEARCH_TASK_MIN_DEPTH || omp_get_num_threads() < 2)
+		return false;
+	if (pendingSearchTasks() >= SEARCH_TASKS_PER_THREAD * omp_get_num_threads())
+		return false;
+	pendingSearchTasks()++;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Tasks spawned and not yet finished
+static std::atomic<int>& pendingSearchTasks() {
+	static std::atomic<int> pending(0);
+	return pending;
+}
+
+static searchbudget& searchBudget() {
+	static searchbudget budget;
+	return budget;
+}
+
+// Give the scramble about to be searched seconds and nodes, 0 for no limit
+static void startBudget(double seconds, long long nodes) {
+	searchbudget& budget = searchBudget();
+	budget.nodes = 0;
+	budget.nodeLimit = nodes;
+	budget.deadline = seconds > 0 ? probeClock() + seconds : 0;
+	budget.exhausted = false;
+	budget.active = seconds > 0 || nodes > 0;
+}
+
+// Count a node against the budget. Each thread adds up its nodes every BUDGET_CHECK_NODES,
+// and then looks at the clock; once either limit is passed, all search threads are stopped.
+static void countNode() {
+	searchbudget& budget = searchBudget();
+	if (!budget.active)
+		return;
+	static thread_local long long counted = 0;
+	if (++counted < BUDGET_CHECK_NODES)
+		return;
+	long long nodes = budget.nodes += counted;
+	counted = 0;
+	if ((budget.nodeLimit > 0 && nodes >= budget.nodeLimit) || (budget.deadline > 0 && probeClock() >= budget.deadline)) {
+		budget.exhausted = true;
+		stopSearch = true;
+	}
+}
+
+static bool budgetExhausted() {
+	return searchBudget().exhausted.load(std::memory_order_relaxed);
+}
+
+// True once enough solutions were found and every thread should unwind
+static bool searchStopped() {
+	return stopSearch.load(std::memory_order_relaxed);
+}
+
+// Lookups for a task or thread of its own, on the NUMA replica of the node it runs on
+// if there is one, starting in a lookup order learned before
+static probeset threadProbes(PieceTypes& datasets, PruneTable& tables, std::vector<std::vector<int> >& order) {
+	probeset local = pruneProbes(datasets, localPruneTables(tables));
+	local.order = order;
+	return local;
+}
+
+// A copy of a position with memory of its own
+static Position copyPosition(Position& state) {
+	Position copy(state.size());
+	for (unsigned int i = 0; i < state.size(); i++) {
+		copy[i] = newSubstate(state[i].size);
+		memcpy(copy[i].permutation, state[i].permutation, state[i].size*sizeof(int));
+		memcpy(copy[i].orientation, state[i].orientation, state[i].size*sizeof(int));
+	}
+	return copy;
+}
+
+static void freePosition(Position& state) {
+	for (unsigned int i = 0; i < state.size(); i++) {
+		delete[] state[i].permutation;
+		delete[] state[i].orientation;
+	}
+}
+
 // does this position count as solved?
 static bool isSolved(Position& state1, Position& state2, Position& ignore, PieceTypes& datasets){
 	if (ignore.size() == 0){
@@ -0,0 +1,140 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for sharing complete pruning tables between ksolve processes. The first
+// process to load a table publishes it as a file in sharedTableDir (normally the
+// shared memory file system), named after its tableKey; later processes map that
+// file read-only instead of keeping a private copy.
+//
+// A segment is written under a temporary name, locked by its publisher, and only
+// linked to its final name once it is complete, so a segment under the final name is
+// always whole. A temporary segment that is not locked was left behind by a process
+// that died while publishing it, and the next publisher takes it over.
+
+#ifndef SHARING_H
+#define SHARING_H
+
+static string sharedTableName(unsigned long long key) {
+	char name[64];
+	sprintf(name, "/ksolve-%016llx", key);
+	return sharedTableDir + name;
+}
+
+// Unlink a segment, unless its name now refers to a newer one
+static void removeSharedTable(string name, int fd) {
+	struct stat opened, named;
+	if (fstat(fd, &opened) == 0 && stat(name.c_str(), &named) == 0 &&
+		opened.st_dev == named.st_dev && opened.st_ino == named.st_ino)
+		unlink(name.c_str());
+}
+
+// Map a published table read-only; false if there is none
+static bool attachSharedTable(unsigned long long key, completetable& table) {
+	string name = sharedTableName(key);
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	sharedtableheader header;
+	bool valid = fstat(fd, &st) == 0 && st.st_size >= (long long) sizeof(header) &&
+		readTableBytes(fd, (char*) &header, sizeof(header), 0) &&
+		header.magic == SHARED_TABLE_MAGIC && header.key == key && header.ready &&
+		st.st_size == (long long) sizeof(header) + header.size;
+	if (!valid) {
+		// segments appear complete under this name, so it is from an older ksolve
+		removeSharedTable(name, fd);
+		close(fd);
+		return false;
+	}
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+	if (tableChecksum((char*) base + sizeof(header), header.size) != header.checksum) {
+		munmap(base, st.st_size);
+		return false;
+	}
+	table.data = (char*) base + sizeof(header);
+	table.size = header.size;
+	table.backing = TABLE_BACKING_MAPPED;
+	table.base = base;
+	table.length = st.st_size;
+	return true;
+}
+
+// Publish a table, then use the shared copy in place of the private one. Nothing
+// happens if the table is already being published or there is no shared memory.
+static void publishSharedTable(unsigned long long key, completetable& table) {
+	if (table.size == 0 || table.disk != NULL)
+		return;
+	string name = sharedTableName(key);
+	string temporary = name + ".new";
+	int fd = open(temporary.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return;
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) { // another process is publishing it
+		close(fd);
+		return;
+	}
+	// it may have been published while we opened the temporary segment
+	completetable shared;
+	if (attachSharedTable(key, shared)) {
+		removeSharedTable(temporary, fd);
+		close(fd);
+		releaseTable(table);
+		table = shared;
+		return;
+	}
+
+	long long length = sizeof(sharedtableheader) + table.size;
+	void *base = MAP_FAILED;
+	if (ftruncate(fd, 0) == 0 && ftruncate(fd, length) == 0)
+		base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		std::cerr << "Could not publish pruning table in " << name << "\n";
+		removeSharedTable(temporary, fd);
+		close(fd);
+		return;
+	}
+	sharedtableheader *header = (sharedtableheader*) base;
+	memset(header, 0, sizeof(sharedtableheader));
+	header->magic = SHARED_TABLE_MAGIC;
+	header->key = key;
+	header->size = table.size;
+	memcpy((char*) base + sizeof(sharedtableheader), table.data, table.size);
+	header->checksum = tableChecksum(table.data, table.size);
+	header->ready = 1;
+	mprotect(base, length, PROT_READ);
+	bool published = link(temporary.c_str(), name.c_str()) == 0;
+	removeSharedTable(temporary, fd);
+	close(fd);
+	if (!published) {
+		munmap(base, length);
+		return;
+	}
+
+	releaseTable(table);
+	table.data = (char*) base + sizeof(sharedtableheader);
+	table.size = header->size;
+	table.backing = TABLE_BACKING_MAPPED;
+	table.base = base;
+	table.length = length;
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for storing pruning tables in memory and in table files
+
+#ifndef TABLEFILE_H
+#define TABLEFILE_H
+
+// Copy a freshly built table to memory of its own, in huge pages if it is large
+static completetable heapTable(const std::vector<char>& entries) {
+	completetable table;
+	table.size = entries.size();
+	table.data = allocateLarge(table.size, table.backing, table.base, table.length);
+	if (table.data == NULL) {
+		std::cerr << "Could not allocate a pruning table of size " << table.size << "\n";
+		exit(-1);
+	}
+	memcpy(table.data, entries.data(), table.size);
+	return table;
+}
+
+// Copy a mapped table into private memory, so a large one can use huge pages
+static void privateTable(completetable& table) {
+	if (table.backing != TABLE_BACKING_MAPPED || table.disk != NULL)
+		return;
+	completetable copy;
+	copy.size = table.size;
+	copy.data = allocateLarge(copy.size, copy.backing, copy.base, copy.length);
+	if (copy.data == NULL)
+		return;
+	memcpy(copy.data, table.data, table.size);
+	releaseTable(table);
+	table = copy;
+}
+
+static void releaseTable(completetable& table) {
+	if (table.data == NULL)
+		return;
+	releaseLarge(table.backing, table.base, table.length);
+	delete table.disk;
+	table.disk = NULL;
+	table.data = NULL;
+	table.size = 0;
+}
+
+static void releasePruneTables(PruneTable& tables) {
+	PruneTable::iterator iter;
+	for (iter = tables.begin(); iter != tables.end(); iter++) {
+		releaseTable(iter->second.permutation);
+		releaseTable(iter->second.orientation);
+	}
+	tables.clear();
+}
+
+static long long tableChunks(long long length) {
+	return (length + TABLE_CHUNK - 1) / TABLE_CHUNK;
+}
+
+static unsigned long long chunkSum(const char *data, long long length, long long c) {
+	return hashBytes(data + c*TABLE_CHUNK, std::min(TABLE_CHUNK, length - c*TABLE_CHUNK), c);
+}
+
+// Hashes of the chunks of a section, computed in parallel
+static std::vector<unsigned long long> chunkSums(const char *data, long long length) {
+	std::vector<unsigned long long> sums(tableChunks(length));
+	#pragma omp parallel for
+	for (long long c = 0; c < (long long) sums.size(); c++)
+		sums[c] = chunkSum(data, length, c);
+	return sums;
+}
+
+static unsigned long long combineSums(const std::vector<unsigned long long>& sums, long long length) {
+	unsigned long long h = length;
+	for (unsigned int c = 0; c < sums.size(); c++)
+		h = hashMix(h, sums[c]);
+	return hashFinish(h);
+}
+
+// Checksum of a section; chunks are hashed in parallel, then combined
+static unsigned long long tableChecksum(const char *data, long long length) {
+	return combineSums(chunkSums(data, length), length);
+}
+
+static long long alignTableOffset(long long offset) {
+	return (offset + TABLE_FILE_ALIGN - 1) / TABLE_FILE_ALIGN * TABLE_FILE_ALIGN;
+}
+
+// Flatten a partial table: all keys, then all depths
+static void packPartialTable(PARTIAL_TABLE_CONTAINER_TYPE& table, std::vector<char>& out, tablesection& section) {
+	section.entries = table.size();
+	section.keysize = table.size() ? table.begin()->first.size() : 0;
+	long long keybytes = section.entries * section.keysize * sizeof(long long);
+	out.resize(keybytes + section.entries);
+	long long *keys = (long long*) out.data();
+	char *depths = out.data() + keybytes;
+	PARTIAL_TABLE_CONTAINER_TYPE::iterator iter;
+	long long i = 0;
+	for (iter = table.begin(); iter != table.end(); iter++, i++) {
+		memcpy(keys + i*section.keysize, iter->first.data(), section.keysize*sizeof(long long));
+		depths[i] = iter->second;
+	}
+}
+
+static void unpackPartialTable(const char *data, tablesection& section, PARTIAL_TABLE_CONTAINER_TYPE& table) {
+	long long keybytes = section.entries * section.keysize * sizeof(long long);
+	const char *depths = data + keybytes;
+	std::vector<long long> key(section.keysize);
+	for (long long i = 0; i < section.entries; i++) {
+		memcpy(key.data(), data + i*section.keysize*sizeof(long long), section.keysize*sizeof(long long));
+		table[key] = depths[i];
+	}
+}
+
+// Write the tables of one set to a file, through a temporary file so a partial write never
+// looks valid. The file does not say which set they are for, as the same set may have
+// another index in another def.
+static bool writeTableFile(string filename, unsigned long long fingerprint, subprune& sub) {
+	std::vector<tablesection> sections;
+	std::vector<const char*> contents;
+	std::vector<std::vector<char> > packed(2);
+	tablesection section;
+	memset(&section, 0, sizeof(section));
+	if (sub.permutation.size > 0 && compressTables && !outOfCoreSize(sub.permutation.size)) {
+		section.kind = SECTION_PERMUTATION_COMPRESSED;
+		section.entries = sub.permutation.size;
+		compressTable(sub.permutation.data, sub.permutation.size, packed[0]);
+		section.length = packed[0].size();
+		contents.push_back(packed[0].data());
+		sections.push_back(section);
+	} else if (sub.permutation.size > 0) {
+		section.kind = SECTION_PERMUTATION_COMPLETE;
+		section.entries = section.length = sub.permutation.size;
+		contents.push_back(sub.permutation.data);
+		sections.push_back(section);
+	} else if (sub.partialpermutation.size() > 0) {
+		section.kind = SECTION_PERMUTATION_PARTIAL;
+		section.depth = sub.partialpermutation_depth;
+		packPartialTable(sub.partialpermutation, packed[0], section);
+		section.length = packed[0].size();
+		contents.push_back(packed[0].data());
+		sections.push_back(section);
+	}
+	if (sub.orientation.size > 0 && compressTables && !outOfCoreSize(sub.orientation.size)) {
+		section.kind = SECTION_ORIENTATION_COMPRESSED;
+		section.entries = sub.orientation.size;
+		section.depth = section.keysize = 0;
+		compressTable(sub.orientation.data, sub.orientation.size, packed[1]);
+		section.length = packed[1].size();
+		contents.push_back(packed[1].data());
+		sections.push_back(section);
+	} else if (sub.orientation.size > 0) {
+		section.kind = SECTION_ORIENTATION_COMPLETE;
+		section.entries = section.length = sub.orientation.size;
+		section.depth = section.keysize = 0;
+		contents.push_back(sub.orientation.data);
+		sections.push_back(section);
+	} else if (sub.partialorientation.size() > 0) {
+		section.kind = SECTION_ORIENTATION_PARTIAL;
+		section.depth = sub.partialorientation_depth;
+		packPartialTable(sub.partialorientation, packed[1], section);
+		section.length = packed[1].size();
+		contents.push_back(packed[1].data());
+		sections.push_back(section);
+	}
+
+	tablefileheader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = TABLE_FILE_MAGIC;
+	header.version = TABLE_FILE_VERSION;
+	header.sections = sections.size();
+	header.fingerprint = fingerprint;
+	long long offset = alignTableOffset(sizeof(header) + sections.size()*sizeof(tablesection));
+	// complete tables are followed by the hash of each chunk, so loading them can check a sample
+	std::vector<std::vector<unsigned long long> > sums(sections.size());
+	for (unsigned int i = 0; i < sections.size(); i++) {
+		sections[i].offset = offset;
+		offset = alignTableOffset(offset + sections[i].length);
+		bool compressed = sections[i].kind == SECTION_PERMUTATION_COMPRESSED || sections[i].kind == SECTION_ORIENTATION_COMPRESSED;
+		bool complete = sections[i].kind == SECTION_PERMUTATION_COMPLETE || sections[i].kind == SECTION_ORIENTATION_COMPLETE;
+		long long length = compressed ? compressedDirectoryLength(contents[i]) : sections[i].length;
+		sums[i] = chunkSums(contents[i], length);
+		sections[i].checksum = combineSums(sums[i], length);
+		if (complete) {
+			sections[i].sums = offset;
+			offset = alignTableOffset(offset + sums[i].size()*sizeof(unsigned long long));
+		}
+	}
+	header.checksum = hashBytes((char*) sections.data(), sections.size()*sizeof(tablesection), fingerprint);
+
+	string tmpname = filename + ".tmp";
+	std::ofstream fout;
+	fout.open(tmpname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!fout.is_open()) {
+		std::cerr << "Could not write pruning tables to " << filename << "\n";
+		return false;
+	}
+	char padding[TABLE_FILE_ALIGN] = {0};
+	fout.write((char*) &header, sizeof(header));
+	fout.write((char*) sections.data(), sections.size()*sizeof(tablesection));
+	long long at = sizeof(header) + sections.size()*sizeof(tablesection);
+	for (unsigned int i = 0; i < sections.size(); i++) {
+		fout.write(padding, sections[i].offset - at);
+		fout.write(contents[i], sections[i].length);
+		at = sections[i].offset + sections[i].length;
+		if (sections[i].sums != 0) {
+			fout.write(padding, sections[i].sums - at);
+			fout.write((char*) sums[i].data(), sums[i].size()*sizeof(unsigned long long));
+			at = sections[i].sums + sums[i].size()*sizeof(unsigned long long);
+		}
+	}
+	fout.close();
+	if (fout.fail() || rename(tmpname.c_str(), filename.c_str()) != 0) {
+		std::cerr << "Could not write pruning tables to " << filename << "\n";
+		remove(tmpname.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool readTableBytes(int fd, char *buffer, long long length, long long offset) {
+	while (length > 0) {
+		ssize_t got = pread(fd, buffer, length, offset);
+		if (got <= 0)
+			return false;
+		buffer += got;
+		length -= got;
+		offset += got;
+	}
+	return true;
+}
+
+// Map a complete table read-only, straight from the file; falls back to reading it into memory
+static completetable mapTableSection(int fd, tablesection& section) {
+	completetable table;
+	long long page = sysconf(_SC_PAGESIZE);
+	long long start = section.offset / page * page;
+	table.length = section.offset + section.length - start;
+	table.base = mmap(NULL, table.length, PROT_READ, MAP_SHARED, fd, start);
+	table.size = section.entries;
+	if (table.base != MAP_FAILED) {
+		table.data = (char*) table.base + (section.offset - start);
+		table.backing = TABLE_BACKING_MAPPED;
+		return table;
+	}
+	table.data = allocateLarge(section.length, table.backing, table.base, table.length);
+	if (table.data != NULL && !readTableBytes(fd, table.data, section.length, section.offset))
+		releaseTable(table);
+	return table;
+}
+
+// Check a complete table against its chunk hashes: they must combine to the section checksum,
+// and a sample of the chunks, spread over the table, must hash to them. The whole table was
+// hashed when it was written; hashing it again would read every page of it at each start.
+static bool sampledChecksum(int fd, tablesection& section, const char *data, long long filesize) {
+	long long chunks = tableChunks(section.length);
+	std::vector<unsigned long long> sums(chunks);
+	if (section.sums % TABLE_FILE_ALIGN != 0 || section.sums + chunks*sizeof(unsigned long long) > (unsigned long long) filesize ||
+		!readTableBytes(fd, (char*) sums.data(), chunks*sizeof(unsigned long long), section.sums) ||
+		combineSums(sums, section.length) != section.checksum)
+		return false;
+	long long samples = std::min(chunks, TABLE_SAMPLE_CHUNKS);
+	for (long long i = 0; i < samples; i++) {
+		long long c = samples == 1 ? 0 : i * (chunks - 1) / (samples - 1);
+		if (chunkSum(data, section.length, c) != sums[c])
+			return false;
+	}
+	return true;
+}
+
+// Read a table file written by writeTableFile into the tables of the set it was looked up
+// for. Complete tables are used in place from the mapping; compressed ones are decompressed
+// into memory.
+static int readTableFile(string filename, unsigned long long fingerprint, subprune& sub) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return TABLE_FILE_MISSING;
+	struct stat st;
+	tablefileheader header;
+	if (fstat(fd, &st) != 0 || st.st_size < (long long) sizeof(header) || !readTableBytes(fd, (char*) &header, sizeof(header), 0) ||
+		header.magic != TABLE_FILE_MAGIC || header.version != TABLE_FILE_VERSION) {
+		close(fd);
+		return TABLE_FILE_CORRUPT;
+	}
+	if (header.fingerprint != fingerprint) {
+		close(fd);
+		return TABLE_FILE_STALE;
+	}
+	std::vector<tablesection> sections(header.sections);
+	if (sizeof(header) + sections.size()*sizeof(tablesection) > (unsigned long long) st.st_size ||
+		!readTableBytes(fd, (char*) sections.data(), sections.size()*sizeof(tablesection), sizeof(header)) ||
+		hashBytes((char*) sections.data(), sections.size()*sizeof(tablesection), fingerprint) != header.checksum) {
+		close(fd);
+		return TABLE_FILE_CORRUPT;
+	}
+
+	int result = TABLE_FILE_OK;
+	for (unsigned int i = 0; i < sections.size() && result == TABLE_FILE_OK; i++) {
+		tablesection& section = sections[i];
+		if (section.offset % TABLE_FILE_ALIGN != 0 || section.offset + section.length > (unsigned long long) st.st_size) {
+			result = TABLE_FILE_CORRUPT;
+			break;
+		}
+		if (section.kind == SECTION_PERMUTATION_COMPLETE || section.kind == SECTION_ORIENTATION_COMPLETE) {
+			completetable table = mapTableSection(fd, section);
+			if (table.data == NULL || !sampledChecksum(fd, section, table.data, st.st_size)) {
+				releaseTable(table);
+				result = TABLE_FILE_CORRUPT;
+			} else if (section.kind == SECTION_PERMUTATION_COMPLETE) {
+				sub.permutation = table;
+			} else {
+				sub.orientation = table;
+			}
+		} else if (section.kind == SECTION_PERMUTATION_COMPRESSED || section.kind == SECTION_ORIENTATION_COMPRESSED) {
+			completetable table;
+			table.size = section.entries;
+			table.data = allocateLarge(table.size, table.backing, table.base, table.length);
+			if (table.data == NULL || !decompressTable(fd, section, table.data)) {
+				releaseTable(table);
+				result = TABLE_FILE_CORRUPT;
+			} else if (section.kind == SECTION_PERMUTATION_COMPRESSED) {
+				sub.permutation = table;
+			} else {
+				sub.orientation = table;
+			}
+		} else if (section.kind == SECTION_PERMUTATION_PARTIAL || section.kind == SECTION_ORIENTATION_PARTIAL) {
+			std::vector<char> buffer(section.length);
+			if (section.length != section.entries * (section.keysize*sizeof(long long) + 1) ||
+				!readTableBytes(fd, buffer.data(), section.length, section.offset) ||
+				tableChecksum(buffer.data(), section.length) != section.checksum) {
+				result = TABLE_FILE_CORRUPT;
+			} else if (section.kind == SECTION_PERMUTATION_PARTIAL) {
+				unpackPartialTable(buffer.data(), section, sub.partialpermutation);
+				sub.partialpermutation_depth = section.depth;
+			} else {
+				unpackPartialTable(buffer.data(), section, sub.partialorientation);
+				sub.partialorientation_depth = section.depth;
+			}
+		} else {
+			result = TABLE_FILE_CORRUPT;
+		}
+	}
+	close(fd);
+	if (result != TABLE_FILE_OK) {
+		releaseTable(sub.permutation);
+		releaseTable(sub.orientation);
+		sub.partialpermutation.clear();
+		sub.partialorientation.clear();
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for the transposition table of the search. It remembers positions whose
+// subtree of a given remaining depth was searched without finding a solution, so other
+// move sequences that lead to the same position at the same depth are not searched again.
+// Only failures are stored, so every distinct solution is still found and counted.
+
+#ifndef TRANSPOSITION_H
+#define TRANSPOSITION_H
+
+static transpositiontable& transpositions() {
+	static transpositiontable table;
+	return table;
+}
+
+// Draw the Zobrist keys and allocate a table of about megabytes MB
+static void initTranspositions(MoveList& moves, PieceTypes& datasets, long long megabytes) {
+	transpositiontable& table = transpositions();
+	unsigned long long seed = 0x7a6f62726973744bULL;
+	int setCount = datasets.size();
+	table.permutationKeys.resize(setCount);
+	table.orientationKeys.resize(setCount);
+	table.orientationStride.resize(setCount);
+	for (int s = 0; s < setCount; s++) {
+		int size = datasets[s].size;
+		int omod = datasets[s].omod;
+		table.permutationKeys[s].resize(size * (size + 2));
+		for (unsigned int i = 0; i < table.permutationKeys[s].size(); i++)
+			table.permutationKeys[s][i] = hashFinish(seed = hashMix(seed, 1));
+		table.orientationStride[s] = omod + 1;
+		table.orientationKeys[s].resize(size * (omod + 1));
+		for (unsigned int i = 0; i < table.orientationKeys[s].size(); i++)
+			table.orientationKeys[s][i] = (omod == 1) ? 0 : hashFinish(seed = hashMix(seed, 2));
+	}
+
+	// the positions each move changes, so hashes are updated with them alone
+	int maxID = -1;
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++)
+		maxID = std::max(maxID, iter->first);
+	table.moveKeys.resize(maxID + 2);
+	for (unsigned int i = 0; i < table.moveKeys.size(); i++)
+		table.moveKeys[i] = hashFinish(seed = hashMix(seed, 3));
+	table.changed.assign(maxID + 1, std::vector<std::vector<int> >(setCount));
+	for (iter = moves.begin(); iter != moves.end(); iter++) {
+		Position& move = iter->second.state;
+		for (int s = 0; s < setCount; s++)
+			for (int i = 0; i < move[s].size; i++)
+				if (move[s].permutation[i] != i + 1 || (datasets[s].omod > 1 && move[s].orientation[i] != 0))
+					table.changed[iter->first][s].push_back(i);
+	}
+
+	unsigned long long buckets = 1;
+	while (buckets * 2 * TRANSPOSITION_BUCKET * sizeof(unsigned long long) <= (unsigned long long) megabytes * 1048576)
+		buckets *= 2;
+	table.buckets = buckets;
+	table.entries = std::vector<std::atomic<unsigned long long> >(buckets * TRANSPOSITION_BUCKET);
+	table.active = false;
+	std::cout << "Transposition table of " << (buckets * TRANSPOSITION_BUCKET * sizeof(unsigned long long) >> 20) << " MB.\n";
+}
+
+// Empty the table for a new scramble, which may ignore other pieces or allow other moves.
+// Sequences with move limits can't be exchanged for others, so then it is not used.
+static void startTranspositions(bool usable) {
+	transpositiontable& table = transpositions();
+	table.active = usable && table.entries.size() > 0;
+	if (!table.active)
+		return;
+	long long count = table.entries.size();
+	#pragma omp parallel for
+	for (long long i = 0; i < count; i++)
+		table.entries[i].store(0, std::memory_order_relaxed);
+}
+
+static unsigned long long pieceKey(transpositiontable& table, substate& set, int s, int i) {
+	return table.permutationKeys[s][i * (set.size + 2) + set.permutation[i] + 1]
+		^ table.orientationKeys[s][i * table.orientationStride[s] + set.orientation[i] + 1];
+}
+
+// Zobrist hash of a whole position; 0 if the table is not used
+static unsigned long long transpositionHash(Position& state) {
+	transpositiontable& table = transpositions();
+	if (!table.active)
+		return 0;
+	unsigned long long hash = 0;
+	for (unsigned int s = 0; s < state.size(); s++)
+		for (int i = 0; i < state[s].size; i++)
+			hash ^= pieceKey(table, state[s], s, i);
+	return hash;
+}
+
+// Hash of new_state, which move made from state with the given hash
+static unsigned long long movedHash(unsigned long long hash, Position& state, Position& new_state, int move) {
+	transpositiontable& table = transpositions();
+	std::vector<std::vector<int> >& changed = table.changed[move];
+	for (unsigned int s = 0; s < changed.size(); s++)
+		for (unsigned int j = 0; j < changed[s].size(); j++) {
+			int i = changed[s][j];
+			hash ^= pieceKey(table, state[s], s, i) ^ pieceKey(table, new_state[s], s, i);
+		}
+	return hash;
+}
+
+// The bucket of a position entered by move; which moves may follow depends on that move
+static std::atomic<unsigned long long>* transpositionBucket(unsigned long long& key, unsigned long long hash, int move) {
+	transpositiontable& table = transpositions();
+	key = hash ^ table.moveKeys[move + 1];
+	return &table.entries[(key & (table.buckets - 1)) * TRANSPOSITION_BUCKET];
+}
+
+// Was the subtree of this position, entered by move, already searched with depth moves left?
+static bool transpositionFailed(unsigned long long hash, int move, int depth) {
+	if (depth < TRANSPOSITION_MIN_DEPTH || depth + 1 > (int) TRANSPOSITION_DEPTH_MASK)
+		return false;
+	unsigned long long key;
+	std::atomic<unsigned long long>* bucket = transpositionBucket(key, hash, move);
+	unsigned long long entry = (key & ~TRANSPOSITION_DEPTH_MASK) | (depth + 1);
+	for (int i = 0; i < TRANSPOSITION_BUCKET; i++)
+		if (bucket[i].load(std::memory_order_relaxed) == entry)
+			return true;
+	return false;
+}
+
+// Remember that the subtree held no solution, in place of the shallowest entry of the bucket.
+// Entries are single words, so threads racing for a bucket at worst lose one of them.
+static void transpositionStore(unsigned long long hash, int move, int depth) {
+	if (depth < TRANSPOSITION_MIN_DEPTH || depth + 1 > (int) TRANSPOSITION_DEPTH_MASK)
+		return;
+	unsigned long long key;
+	std::atomic<unsigned long long>* bucket = transpositionBucket(key, hash, move);
+	unsigned long long entry = (key & ~TRANSPOSITION_DEPTH_MASK) | (depth + 1);
+	int victim = 0;
+	unsigned long long victimDepth = TRANSPOSITION_DEPTH_MASK + 1;
+	for (int i = 0; i < TRANSPOSITION_BUCKET; i++) {
+		unsigned long long old = bucket[i].load(std::memory_order_relaxed);
+		if (old == entry)
+			return;
+		if ((old & TRANSPOSITION_DEPTH_MASK) < victimDepth) {
+			victim = i;
+			victimDepth = old & TRANSPOSITION_DEPTH_MASK;
+		}
+	}
+	bucket[victim].store(entry, std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ KSolve+ - Puzzle solving program.
+ Copyright (C) 2007-2013 Kre Krig and Michael Gottlieb
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Functions for the two-phase solver (TwoPhase in the scramble file). Phase 1 brings the
+// scramble into the subgroup generated by the def's Subgroup moves, and phase 2 solves
+// it with those moves alone. Each phase has pruning tables of its own: phase 1 those of
+// the puzzle with the pieces relabelled by the orbit of the subgroup they belong to, and
+// phase 2 those for the subgroup's moves. Solutions are not optimal, but come fast;
+// longer phase 1 solutions are tried for a shorter total until the time is up.
+
+#ifndef TWOPHASE_H
+#define TWOPHASE_H
+
+static twophasepuzzle& twoPhasePuzzle() {
+	static twophasepuzzle puzzle;
+	return puzzle;
+}
+
+// Can this scramble be solved in two phases? If not, says so, and what is done instead.
+static bool twoPhaseUsable(ScrambleDef& scramble, std::vector<Block>& blocks, string otherwise) {
+	bool unknown = false;
+	for (unsigned int s = 0; s < scramble.state.size(); s++)
+		for (int i = 0; i < scramble.state[s].size; i++)
+			unknown = unknown || scramble.state[s].permutation[i] < 1;
+	if (twoPhasePuzzle().subgroup.empty())
+		std::cout << "No Subgroup in the def file, " << otherwise << ".\n";
+	else if (blocks.size() != 0)
+		std::cout << "The two-phase solver can't be used with Blocks, " << otherwise << ".\n";
+	else if (scramble.moveLimits.size() != 0)
+		std::cout << "The two-phase solver can't be used with MoveLimits, " << otherwise << ".\n";
+	else if (scramble.metric == 1)
+		std::cout << "The two-phase solver can't be used in QTM, " << otherwise << ".\n";
+	else if (unknown)
+		std::cout << "The two-phase solver can't be used with unknown pieces, " << otherwise << ".\n";
+	else
+		return true;
+	return false;
+}
+
+// Work out the puzzle phase 1 sees, and load or build its tables. Positions that the
+// subgroup's moves connect form an orbit, and so do the positions of a repeated label;
+// a piece only has to reach its orbit. Where a subgroup move changes an orientation,
+// the orientations in that orbit are left to phase 2.
+static void twoPhasePrepare(Position& solved, MoveList& moves, PieceTypes& datasets, Position& ignore, bool usePruneTable) {
+	twophasepuzzle& puzzle = twoPhasePuzzle();
+	if (puzzle.ready)
+		return;
+	puzzle.ready = true;
+	int sets = solved.size();
+	puzzle.relabel.resize(sets);
+	puzzle.solved = copyPosition(solved);
+	puzzle.datasets = datasets;
+	if (ignore.size() != 0) {
+		puzzle.ignore = copyPosition(ignore);
+	} else {
+		puzzle.ignore.resize(sets);
+		for (int s = 0; s < sets; s++) {
+			puzzle.ignore[s] = newSubstate(solved[s].size);
+			memset(puzzle.ignore[s].permutation, 0, solved[s].size*sizeof(int));
+			memset(puzzle.ignore[s].orientation, 0, solved[s].size*sizeof(int));
+		}
+	}
+
+	for (int s = 0; s < sets; s++) {
+		int size = solved[s].size;
+		std::vector<int> orbit(size);
+		for (int i = 0; i < size; i++)
+			orbit[i] = i;
+		MoveList::iterator iter;
+		for (iter = puzzle.subgroup.begin(); iter != puzzle.subgroup.end(); iter++)
+			for (int i = 0; i < size; i++)
+				twoPhaseJoin(orbit, i, iter->second.state[s].permutation[i] - 1);
+		int labels = 0;
+		for (int i = 0; i < size; i++)
+			labels = std::max(labels, solved[s].permutation[i]);
+		std::vector<int> seen(labels + 1, -1);
+		for (int i = 0; i < size; i++) {
+			int label = solved[s].permutation[i];
+			if (seen[label] >= 0)
+				twoPhaseJoin(orbit, i, seen[label]);
+			seen[label] = i;
+		}
+
+		// number the orbits from 1, and see which can change orientation
+		std::vector<int> number(size, 0);
+		std::vector<char> turned(size, 0);
+		int orbits = 0;
+		for (int i = 0; i < size; i++)
+			if (number[twoPhaseRoot(orbit, i)] == 0)
+				number[twoPhaseRoot(orbit, i)] = ++orbits;
+		for (iter = puzzle.subgroup.begin(); iter != puzzle.subgroup.end(); iter++)
+			for (int i = 0; i < size; i++)
+				if (datasets[s].omod > 1 && iter->second.state[s].orientation[i] != 0)
+					turned[twoPhaseRoot(orbit, i)] = 1;
+
+		puzzle.relabel[s].assign(labels + 1, 0);
+		for (int i = 0; i < size; i++) {
+			int root = twoPhaseRoot(orbit, i);
+			puzzle.relabel[s][solved[s].permutation[i]] = number[root];
+			puzzle.solved[s].permutation[i] = number[root];
+			if (turned[root]) {
+				puzzle.ignore[s].orientation[i] = 1;
+				puzzle.solved[s].orientation[i] = 0;
+			}
+		}
+		dataset& ds = puzzle.datasets[s];
+		ds.uniqueperm = orbits == size;
+		ds.maxInSolved = orbits;
+		ds.permbits = 0;
+		while ((1LL << ds.permbits) < orbits - 1)
+			ds.permbits++;
+	}
+
+	if (!skipPrune) {
+		std::vector<Block> noBlocks;
+		puzzle.tables = getCompletePruneTables(puzzle.solved, moves, puzzle.datasets, puzzle.ignore, noBlocks, tableCacheDir, usePruneTable, false);
+		std::cout << "Two-phase tables loaded.\n";
+	}
+	updateDatasets(puzzle.datasets, puzzle.tables);
+	puzzle.probes = pruneProbes(puzzle.datasets, puzzle.tables);
+}
+
+static int twoPhaseRoot(std::vector<int>& orbit, int i) {
+	while (orbit[i] != i)
+		i = orbit[i] = orbit[orbit[i]];
+	return i;
+}
+
+static void twoPhaseJoin(std::vector<int>& orbit, int i, int j) {
+	orbit[twoPhaseRoot(orbit, i)] = twoPhaseRoot(orbit, j);
+}
+
+// A position as phase 1 sees it
+static void twoPhaseProject(Position& state, Position& projected) {
+	twophasepuzzle& puzzle = twoPhasePuzzle();
+	for (unsigned int s = 0; s < state.size(); s++)
+		for (int i = 0; i < state[s].size; i++) {
+			projected[s].permutation[i] = puzzle.relabel[s][state[s].permutation[i]];
+			projected[s].orientation[i] = state[s].orientation[i];
+		}
+}
+
+// Solve within the subgroup in exactly depth - level more moves; the moves are left in
+// the path after the phase 1 moves
+static bool twoPhaseSecond(twophasesearch& search, Position& solved, PieceTypes& datasets, std::set<MovePair>& forbiddenPairs, int first, int level, int depth, int old_move) {
+	Position& state = search.second[level];
+	if (level == depth)
+		return isSolved(state, solved, search.scramble->ignore, datasets);
+	for (unsigned int m = 0; m < search.subgroup.size(); m++) {
+		int id = search.subgroup[m]->first;
+		if (forbiddenPairs.find(MovePair(old_move, id)) != forbiddenPairs.end())
+			continue;
+		applyMove(state, search.second[level + 1], search.subgroup[m]->second.state, datasets);
+		if (!skipPrune && prune(search.second[level + 1], depth - level - 1, search.probes))
+			continue;
+		search.path[first + level] = id;
+		if (twoPhaseSecond(search, solved, datasets, forbiddenPairs, first, level + 1, depth, id))
+			return true;
+	}
+	return false;
+}
+
+// All phase 1 solutions of exactly depth moves; each one that reaches the subgroup is
+// finished by the shortest phase 2 that beats the best solution so far
+static void twoPhaseFirst(twophasesearch& search, Position& solved, MoveList& moves, PieceTypes& datasets, std::set<MovePair>& forbiddenPairs, int level, int depth, int old_move) {
+	twophasepuzzle& puzzle = twoPhasePuzzle();
+	if (search.found && ++search.nodes % TWOPHASE_CLOCK_INTERVAL == 0 && clock() > search.deadline)
+		stopSearch = true;
+	if (level == depth) {
+		if (!isSolved(search.first[level], puzzle.solved, puzzle.ignore, puzzle.datasets))
+			return;
+		// ending with a subgroup move, a shorter phase 1 was there already
+		if (depth > 0 && puzzle.subgroup.find(old_move) != puzzle.subgroup.end())
+			return;
+		Position *from = &search.scramble->state;
+		for (int i = 0; i < depth; i++) {
+			Position *to = (i == depth - 1) ? &search.second[0] : &search.replay[i % 2];
+			applyMove(*from, *to, moves[search.path[i]].state, datasets);
+			from = to;
+		}
+		if (depth == 0)
+			for (unsigned int s = 0; s < solved.size(); s++) {
+				memcpy(search.second[0][s].permutation, from->at(s).permutation, solved[s].size*sizeof(int));
+				memcpy(search.second[0][s].orientation, from->at(s).orientation, solved[s].size*sizeof(int));
+			}
+		int limit = search.found ? (int) search.best.size() - depth - 1 : std::min(TWOPHASE_MAX_SECOND, search.scramble->max_depth - depth);
+		for (int second = 0; second <= limit; second++) {
+			if (!twoPhaseSecond(search, solved, datasets, forbiddenPairs, depth, 0, second, old_move))
+				continue;
+			search.found = true;
+			search.best.assign(search.path.begin(), search.path.begin() + depth + second);
+			string sequence = " ";
+			for (unsigned int i = 0; i < search.best.size(); i++)
+				sequence += " " + moves[search.best[i]].name;
+			std::cout << "Length " << search.best.size() << " (" << depth << " + " << second << "), time " << (clock() - search.start) / (double)CLOCKS_PER_SEC << "s\n";
+			std::cout << sequence << "\n";
+			if (search.scramble->twoPhase == 0)
+				stopSearch = true;
+			break;
+		}
+		return;
+	}
+	for (unsigned int m = 0; m < search.moves.size() && !searchStopped(); m++) {
+		int id = search.moves[m]->first;
+		if (forbiddenPairs.find(MovePair(old_move, id)) != forbiddenPairs.end())
+			continue;
+		applyMove(search.first[level], search.first[level + 1], search.moves[m]->second.state, datasets);
+		if (!skipPrune && prune(search.first[level + 1], depth - level - 1, puzzle.probes))
+			continue;
+		search.path[level] = id;
+		twoPhaseFirst(search, solved, moves, datasets, forbiddenPairs, level + 1, depth, id);
+	}
+}
+
+// Solve a scramble in two phases, trying longer phase 1 solutions for a shorter total for
+// scramble.twoPhase seconds after the first solution
+static void twoPhaseSolve(ScrambleDef& scramble, Position& solved, MoveList& moves, PieceTypes& datasets, Position& ignore, std::set<MovePair>& forbiddenPairs, bool usePruneTable) {
+	twophasepuzzle& puzzle = twoPhasePuzzle();
+	twoPhasePrepare(solved, moves, datasets, ignore, usePruneTable);
+	std::vector<Block> noBlocks;
+	twophasesearch search;
+	search.scramble = &scramble;
+	MoveList::iterator iter;
+	for (iter = moves.begin(); iter != moves.end(); iter++)
+		search.moves.push_back(iter);
+	for (iter = puzzle.subgroup.begin(); iter != puzzle.subgroup.end(); iter++)
+		search.subgroup.push_back(moves.find(iter->first));
+	// the tables need the inverses of the subgroup's moves, which the def may not list (U' alone)
+	MoveList tableMoves;
+	if (!inverseClosure(moves, puzzle.subgroup, datasets, tableMoves))
+		tableMoves = moves;
+	PruneTable noTables;
+	PruneTable& tables = skipPrune ? noTables : restrictedPruneTables(solved, moves, tableMoves, datasets, ignore, noBlocks, tableCacheDir, usePruneTable);
+	PieceTypes secondDatasets = datasets;
+	updateDatasets(secondDatasets, tables);
+	search.probes = pruneProbes(secondDatasets, tables);
+
+	int levels = TWOPHASE_MAX_FIRST + TWOPHASE_MAX_SECOND + 1;
+	search.first.resize(levels);
+	search.second.resize(levels);
+	for (int level = 0; level < levels; level++) {
+		search.first[level] = copyPosition(solved);
+		search.second[level] = copyPosition(solved);
+	}
+	search.replay[0] = copyPosition(solved);
+	search.replay[1] = copyPosition(solved);
+	search.path.assign(levels, -1);
+	search.found = false;
+	search.nodes = 0;
+	search.start = clock();
+	search.deadline = search.start + (clock_t) (scramble.twoPhase * CLOCKS_PER_SEC);
+	stopSearch = false;
+
+	twoPhaseProject(scramble.state, search.first[0]);
+	for (int depth = 0; depth <= std::min(TWOPHASE_MAX_FIRST, scramble.max_depth) && !searchStopped(); depth++) {
+		if (search.found && depth >= (int) search.best.size())
+			break;
+		twoPhaseFirst(search, solved, moves, datasets, forbiddenPairs, 0, depth, -1);
+	}
+	if (!search.found)
+		std::cout << "No two-phase solution found.\n";
+
+	for (int level = 0; level < levels; level++) {
+		freePosition(search.first[level]);
+		freePosition(search.second[level]);
+	}
+	freePosition(search.replay[0]);
+	freePosition(search.replay[1]);
+}
+
+#endif